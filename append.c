@@ -22,22 +22,1702 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <ctype.h>
 #include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+
+#if defined(WIN32) || defined(_MSC_VER)
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#define HAVE_MMAP
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #if defined(WIN32) || defined(_MSC_VER)
 #define strcasecmp _stricmp
 #define strncasecmp _strnicmp
 #endif
 
-#include "common.h"
+#ifdef _MSC_VER
+#define S_ISDIR(x) ((x) & _S_IFDIR)
+#define S_ISREG(x) ((x) & _S_IFREG)
+typedef int ssize_t;
+#endif
+
+#include "common.h"
+
+/* Files which cannot be mapped up to this size are read to memory by worker thread, bigger files are streamed by writer */
+#define PRELOAD_MAX 0x800000
+
+/* Size of buffer for streaming files which cannot be mapped */
+#define STREAM_BUFFER 0x100000
+
+/* Values returned by parseCompression for method choose */
+#define CHOOSE			1
+#define CHOOSE_ADPCM		2
+
+/* Settings of append session, shared by all threads */
+struct session {
+
+	HANDLE SArchive;
+	const char * archive;
+	unsigned int flags;
+	unsigned int locale;
+
+	unsigned int SFlags;
+	unsigned int SCompFlags;
+	int choose;
+
+	unsigned int sectorSize;
+	const struct smpq_options * options;
+
+	/* Files and bytes written since archive tables were flushed last time (only writer thread use them) */
+	unsigned int uncommittedFiles;
+	unsigned long long int uncommittedBytes;
+	unsigned int maxUncommittedFiles;
+	unsigned long long int maxUncommittedBytes;
+	unsigned int commits;
+
+	/* Statistics of flag UPDATE */
+	unsigned int skippedFiles;
+	unsigned long long int skippedBytes;
+	unsigned int replacedFiles;
+
+};
+
+/* Prepared input file waiting for commit to archive */
+struct input {
+
+	const char * fileName;
+	char localName[1024];
+	char SFileName[1024];
+	unsigned long long int SFileTime;
+	size_t fileSize;
+
+	unsigned int locale;
+	unsigned int SFlags;
+	unsigned int SCompFlags;
+	int choose;
+	const char * method;
+
+	unsigned char md5[16];
+	int hasMd5;
+
+	int fd;
+	unsigned char * data;
+	int mapped;
+
+	const char * message;
+	const char * messageFile;
+	int errnum;
+
+	int ready;
+
+};
+
+/* Rule of compression policy, pattern is glob matched against name in archive */
+struct rule {
+
+	char * pattern;
+
+	int hasCompression;
+	int choose;
+	unsigned int SFlags;
+	unsigned int SCompFlags;
+	const char * method;
+
+	int hasFlags;
+	unsigned int fileFlags;
+
+};
+
+/* Source of input files, first command line arguments, then lines of manifest and then files of tar or zip archive, settings of files are taken from policy */
+struct source {
+
+	const char * const * files;
+	unsigned int index;
+
+	FILE * manifest;
+	const char * manifestName;
+	unsigned int line;
+
+	struct rule * policy;
+	unsigned int rules;
+
+	struct container * container;
+	const char * containerName;
+
+};
+
+/* File flags which can be set for each file by manifest or policy */
+#define FILE_FLAGS ( MPQ_FILE_ENCRYPTED | MPQ_FILE_FIX_KEY | MPQ_FILE_DELETE_MARKER | MPQ_FILE_SINGLE_UNIT | MPQ_FILE_SECTOR_CRC )
+
+/**
+ * Candidate methods for compression method choose, ordered from fastest decompression
+ *
+ * Decode cost is fixed estimate of decompression time in nanoseconds for 1 KiB of sector, so choose does not depend on load of machine.
+ */
+static const struct method {
+
+	const char * name;
+	unsigned int SCompFlags;
+	unsigned int channels;
+	unsigned int decodeCost;
+
+} methods[] = {
+
+	{ "SPARSE", MPQ_COMPRESSION_SPARSE, 0, 250 },
+	{ "ZLIB", MPQ_COMPRESSION_ZLIB, 0, 3000 },
+	{ "SPARSE+ZLIB", MPQ_COMPRESSION_SPARSE | MPQ_COMPRESSION_ZLIB, 0, 3250 },
+	{ "PKWARE", MPQ_COMPRESSION_PKWARE, 0, 5000 },
+	{ "SPARSE+PKWARE", MPQ_COMPRESSION_SPARSE | MPQ_COMPRESSION_PKWARE, 0, 5250 },
+	{ "ZLIB+PKWARE", MPQ_COMPRESSION_ZLIB | MPQ_COMPRESSION_PKWARE, 0, 8000 },
+	{ "BZIP2", MPQ_COMPRESSION_BZIP2, 0, 25000 },
+	{ "SPARSE+BZIP2", MPQ_COMPRESSION_SPARSE | MPQ_COMPRESSION_BZIP2, 0, 25250 },
+	{ "LZMA", MPQ_COMPRESSION_LZMA, 0, 10000 },
+	{ "HUFFMANN+ADPCM_MONO", MPQ_COMPRESSION_HUFFMANN | MPQ_COMPRESSION_ADPCM_MONO, 1, 8000 },
+	{ "HUFFMANN+ADPCM_STEREO", MPQ_COMPRESSION_HUFFMANN | MPQ_COMPRESSION_ADPCM_STEREO, 2, 8000 },
+
+};
+
+/* Convert compression method name to file and compression flags, return -1 for unknown method or CHOOSE* for method choose */
+static int parseCompression(const char * compression, unsigned int * SFlags, unsigned int * SCompFlags) {
+
+	*SCompFlags = 0;
+	*SFlags &= ~( MPQ_FILE_COMPRESS | MPQ_FILE_IMPLODE );
+
+	if ( strcmp(compression, "none") == 0 )
+		return 0;
+
+	if ( strcasecmp(compression, "IMPLODE") == 0 ) {
+
+		*SFlags |= MPQ_FILE_IMPLODE;
+		return 0;
+
+	}
+
+	if ( strcasecmp(compression, "choose") == 0 )
+		return CHOOSE;
+
+	if ( strcasecmp(compression, "choose+ADPCM") == 0 )
+		return CHOOSE_ADPCM;
+
+	*SFlags |= MPQ_FILE_COMPRESS;
+
+	if ( strcasecmp(compression, "HUFFMANN") == 0 )
+		*SCompFlags |= MPQ_COMPRESSION_HUFFMANN;
+	else if ( strcasecmp(compression, "ADPCM_MONO") == 0 )
+		*SCompFlags |= MPQ_COMPRESSION_ADPCM_MONO;
+	else if ( strcasecmp(compression, "ADPCM_STEREO") == 0 )
+		*SCompFlags |= MPQ_COMPRESSION_ADPCM_STEREO;
+	else if ( strcasecmp(compression, "ZLIB") == 0 )
+		*SCompFlags |= MPQ_COMPRESSION_ZLIB;
+	else if ( strcasecmp(compression, "PKWARE") == 0 )
+		*SCompFlags |= MPQ_COMPRESSION_PKWARE;
+	else if ( strcasecmp(compression, "BZIP2") == 0 )
+		*SCompFlags |= MPQ_COMPRESSION_BZIP2;
+	else if ( strcasecmp(compression, "SPARSE") == 0 )
+		*SCompFlags |= MPQ_COMPRESSION_SPARSE;
+	else if ( strcasecmp(compression, "LZMA") == 0 )
+		*SCompFlags |= MPQ_COMPRESSION_LZMA;
+	else if ( strcasecmp(compression, "HUFFMANN+ADPCM_MONO") == 0 )
+		*SCompFlags |= MPQ_COMPRESSION_HUFFMANN | MPQ_COMPRESSION_ADPCM_MONO;
+	else if ( strcasecmp(compression, "HUFFMANN+ADPCM_STEREO") == 0 )
+		*SCompFlags |= MPQ_COMPRESSION_HUFFMANN | MPQ_COMPRESSION_ADPCM_STEREO;
+	else if ( strcasecmp(compression, "ZLIB+PKWARE") == 0 )
+		*SCompFlags |= MPQ_COMPRESSION_ZLIB | MPQ_COMPRESSION_PKWARE;
+	else if ( strcasecmp(compression, "BZIP2+PKWARE") == 0 )
+		*SCompFlags |= MPQ_COMPRESSION_BZIP2 | MPQ_COMPRESSION_PKWARE;
+	else if ( strcasecmp(compression, "SPARSE+ZLIB") == 0 )
+		*SCompFlags |= MPQ_COMPRESSION_SPARSE | MPQ_COMPRESSION_ZLIB;
+	else if ( strcasecmp(compression, "SPARSE+PKWARE") == 0 )
+		*SCompFlags |= MPQ_COMPRESSION_SPARSE | MPQ_COMPRESSION_PKWARE;
+	else if ( strcasecmp(compression, "SPARSE+BZIP2") == 0 )
+		*SCompFlags |= MPQ_COMPRESSION_SPARSE | MPQ_COMPRESSION_BZIP2;
+	else if ( strcasecmp(compression, "SPARSE+ZLIB+PKWARE") == 0 )
+		*SCompFlags |= MPQ_COMPRESSION_SPARSE | MPQ_COMPRESSION_ZLIB | MPQ_COMPRESSION_PKWARE;
+	else if ( strcasecmp(compression, "SPARSE+BZIP2+PKWARE") == 0 )
+		*SCompFlags |= MPQ_COMPRESSION_SPARSE | MPQ_COMPRESSION_BZIP2 | MPQ_COMPRESSION_PKWARE;
+	else
+		return -1;
+
+	return 0;
+
+}
+
+/* Convert letters of options E, F, D, U, S (or - for none) to file flags, return -1 for unknown letter */
+static int parseFileFlags(const char * letters, unsigned int * SFlags) {
+
+	const char * c;
+
+	*SFlags &= ~FILE_FLAGS;
+
+	for ( c = letters; *c; ++c ) {
+
+		if ( *c == 'E' )
+			*SFlags |= MPQ_FILE_ENCRYPTED;
+		else if ( *c == 'F' )
+			*SFlags |= MPQ_FILE_FIX_KEY;
+		else if ( *c == 'D' )
+			*SFlags |= MPQ_FILE_DELETE_MARKER;
+		else if ( *c == 'U' )
+			*SFlags |= MPQ_FILE_SINGLE_UNIT;
+		else if ( *c == 'S' )
+			*SFlags |= MPQ_FILE_SECTOR_CRC;
+		else if ( *c != '-' )
+			return -1;
+
+	}
+
+	return 0;
+
+}
+
+/* Return number of channels of 16 bit PCM WAVE data or 0 if data are not WAVE */
+static unsigned int waveChannels(const unsigned char * data, size_t size) {
+
+	if ( size < 44 || memcmp(data, "RIFF", 4) != 0 || memcmp(data + 8, "WAVEfmt ", 8) != 0 )
+		return 0;
+
+	/* Format tag PCM and 16 bits per sample */
+	if ( data[20] != 1 || data[21] != 0 || data[34] != 16 || data[35] != 0 )
+		return 0;
+
+	if ( data[23] != 0 || ( data[22] != 1 && data[22] != 2 ) )
+		return 0;
+
+	return data[22];
+
+}
+
+/* Read up to size bytes from file descriptor, return number of read bytes or -1 on error */
+static ssize_t readInput(int fd, unsigned char * buffer, size_t size) {
+
+	size_t done = 0;
+
+	while ( done < size ) {
+
+		ssize_t bytes = read(fd, buffer + done, size - done);
+
+		if ( bytes < 0 && errno == EINTR )
+			continue;
+
+		if ( bytes < 0 )
+			return -1;
+
+		if ( bytes == 0 )
+			break;
+
+		done += bytes;
+
+	}
+
+	return done;
+
+}
+
+/* Return first sectors of input file (data of file or allocated buffer) for compression sampling, NULL on error or for empty file */
+static unsigned char * readSample(const struct session * s, struct input * in, size_t * sampleSize) {
+
+	unsigned char * sample;
+
+	*sampleSize = in->fileSize;
+
+	if ( s->options->sampleSectors != 0 && *sampleSize > (size_t)s->options->sampleSectors * s->sectorSize )
+		*sampleSize = (size_t)s->options->sampleSectors * s->sectorSize;
+
+	if ( *sampleSize == 0 )
+		return NULL;
+
+	if ( in->data )
+		return in->data;
+
+	sample = (unsigned char *)malloc(*sampleSize);
+
+	if ( ! sample )
+		return NULL;
+
+	if ( readInput(in->fd, sample, *sampleSize) != (ssize_t)*sampleSize ) {
+
+		free(sample);
+		sample = NULL;
+
+	}
+
+	lseek(in->fd, 0, SEEK_SET);
+
+	return sample;
+
+}
+
+/**
+ * Choose compression method for input file
+ *
+ * First sectors of file are compressed by each candidate method. Cost of method is size of compressed sectors plus estimated
+ * decompression time of compressed sectors in microseconds (from decode cost) multiplied by decode weight. Method with lowest cost is used, but only
+ * when it saves at least min gain percent of size, otherwise file is stored without compression.
+ */
+static void chooseCompression(const struct session * s, struct input * in) {
+
+	const struct smpq_options * options = s->options;
+	unsigned char * sample;
+	size_t sampleSize;
+	unsigned char * out = NULL;
+	unsigned int channels = 0;
+	unsigned long long int bestCost = 0;
+	size_t bestSize = 0;
+	int best = -1;
+	unsigned int i;
+
+	in->SFlags &= ~( MPQ_FILE_COMPRESS | MPQ_FILE_IMPLODE );
+	in->SCompFlags = 0;
+	in->method = "none";
+
+	sample = readSample(s, in, &sampleSize);
+
+	if ( ! sample )
+		return;
+
+	/* Some compressors need bigger output buffer for incompressible data */
+	out = (unsigned char *)malloc(2 * s->sectorSize + 64);
+
+	if ( ! out )
+		goto out;
+
+	if ( in->choose == CHOOSE_ADPCM )
+		channels = waveChannels(sample, sampleSize);
+
+	for ( i = 0; i < sizeof(methods) / sizeof(methods[0]); ++i ) {
+
+		size_t offset;
+		size_t size = 0;
+		unsigned long long int work = 0;
+		unsigned long long int cost;
+
+		if ( methods[i].channels != 0 && methods[i].channels != channels )
+			continue;
+
+		for ( offset = 0; offset < sampleSize; offset += s->sectorSize ) {
+
+			int length = sampleSize - offset < s->sectorSize ? sampleSize - offset : s->sectorSize;
+			int outLength = 2 * s->sectorSize + 64;
+
+			/* First sector of WAVE file contains header, it is never compressed by lossy method */
+			if ( methods[i].channels != 0 && offset == 0 ) {
+
+				size += length;
+				continue;
+
+			}
+
+			if ( ! SCompCompress(out, &outLength, sample + offset, length, methods[i].SCompFlags, 0, 0) || outLength >= length ) {
+
+				/* StormLib stores such sector without compression */
+				size += length;
+				continue;
+
+			}
+
+			size += outLength;
+			work += (unsigned long long int)methods[i].decodeCost * length;
+
+		}
+
+		/* Work is in nanoseconds for 1 KiB, so divide it by 1024 and 1000 to microseconds */
+		cost = size + options->decodeWeight * ( work / 1024000 );
+
+		if ( best == -1 || cost < bestCost ) {
+
+			best = i;
+			bestCost = cost;
+			bestSize = size;
+
+		}
+
+	}
+
+	if ( best == -1 || (unsigned long long int)bestSize * 100 > (unsigned long long int)sampleSize * ( 100 - options->minGain ) )
+		goto out;
+
+	in->SFlags |= MPQ_FILE_COMPRESS;
+	in->SCompFlags = methods[best].SCompFlags;
+	in->method = methods[best].name;
+
+out:
+	if ( sample != in->data )
+		free(sample);
+
+	free(out);
+
+}
+
+/* Return base 2 logarithm of x as fixed point number with 16 fractional bits */
+static unsigned int log2Fixed(unsigned int x) {
+
+	unsigned long long int y;
+	unsigned int result;
+	int bit = 0;
+	int i;
+
+	if ( x == 0 )
+		return 0;
+
+	while ( x >> ( bit + 1 ) )
+		++bit;
+
+	result = (unsigned int)bit << 16;
+	y = ( (unsigned long long int)x << 31 ) >> bit;
+
+	/* Now y is in range [1, 2) with 31 fractional bits, each squaring gives next bit of result */
+	for ( i = 15; i >= 0; --i ) {
+
+		y = ( y * y ) >> 31;
+
+		if ( y >= ( 2ULL << 31 ) ) {
+
+			y >>= 1;
+			result |= 1U << i;
+
+		}
+
+	}
+
+	return result;
+
+}
+
+/**
+ * Check if input file is compressible by order 0 entropy of its first sectors
+ *
+ * Sectors are compressed separately, so entropy is computed for each sector. When estimated saved size is less than
+ * min gain percent, file is stored without compression. Entropy does not see repeated strings, so this is only fast
+ * check for already compressed data (audio, images, archives) which does not run any compressor.
+ */
+static void checkEntropy(const struct session * s, struct input * in) {
+
+	unsigned char * sample;
+	size_t sampleSize;
+	size_t offset;
+	unsigned long long int bits = 0;
+
+	sample = readSample(s, in, &sampleSize);
+
+	if ( ! sample )
+		return;
+
+	for ( offset = 0; offset < sampleSize; offset += s->sectorSize ) {
+
+		unsigned int counts[256];
+		unsigned int length = sampleSize - offset < s->sectorSize ? sampleSize - offset : s->sectorSize;
+		unsigned int logLength = log2Fixed(length);
+		unsigned int i;
+
+		memset(counts, 0, sizeof(counts));
+
+		for ( i = 0; i < length; ++i )
+			++counts[sample[offset + i]];
+
+		for ( i = 0; i < 256; ++i )
+			if ( counts[i] )
+				bits += (unsigned long long int)counts[i] * ( logLength - log2Fixed(counts[i]) );
+
+	}
+
+	if ( sample != in->data )
+		free(sample);
+
+	/* Estimated compressed size in bytes is bits / 8 / 65536 */
+	if ( ( bits >> 19 ) * 100 > (unsigned long long int)sampleSize * ( 100 - s->options->minGain ) ) {
+
+		in->SFlags &= ~( MPQ_FILE_COMPRESS | MPQ_FILE_IMPLODE );
+		in->SCompFlags = 0;
+		in->method = "none";
+
+	}
+
+}
+
+/* Compare characters of names in archive, case insensitive and both slashes are same */
+static int sameChar(char a, char b) {
+
+	if ( a == '/' )
+		a = '\\';
+
+	if ( b == '/' )
+		b = '\\';
+
+	return tolower((unsigned char)a) == tolower((unsigned char)b);
+
+}
+
+/* Match name against glob pattern with wildcards * and ? */
+static int matchPattern(const char * pattern, const char * name) {
+
+	const char * star = NULL;
+	const char * back = NULL;
+
+	while ( *name ) {
+
+		if ( *pattern == '*' ) {
+
+			star = ++pattern;
+			back = name;
+
+		} else if ( *pattern && ( *pattern == '?' || sameChar(*pattern, *name) ) ) {
+
+			++pattern;
+			++name;
+
+		} else if ( star ) {
+
+			pattern = star;
+			name = ++back;
+
+		} else {
+
+			return 0;
+
+		}
+
+	}
+
+	while ( *pattern == '*' )
+		++pattern;
+
+	return *pattern == 0;
+
+}
+
+/**
+ * Load compression policy file to source, return -1 on error
+ *
+ * Each line has tab separated fields: pattern, compression and flags (letters of options E, F, D, U, S or - for none).
+ * Empty or missing fields do not change settings of file. Pattern without slash is matched against file name without
+ * directory, pattern .ext is same as *.ext. First rule with matching pattern is used.
+ */
+static int loadPolicy(const char * archive, unsigned int flags, struct source * src, const char * policy) {
+
+	FILE * file = fopen(policy, "r");
+	char line[4096];
+	unsigned int lines = 0;
+	unsigned int allocated = 0;
+
+	if ( ! file ) {
+
+		if ( ! ( flags & QUIET ) )
+			printError(archive, "Cannot open policy", policy, errno);
+
+		return -1;
+
+	}
+
+	while ( fgets(line, sizeof(line), file) ) {
+
+		char * fields[3] = { NULL, NULL, NULL };
+		char * field = line;
+		struct rule * rule;
+		size_t len;
+		unsigned int i;
+		int error = 0;
+
+		++lines;
+		line[strcspn(line, "\r\n")] = 0;
+
+		if ( line[0] == 0 || line[0] == '#' )
+			continue;
+
+		for ( i = 0; i < 3 && field; ++i ) {
+
+			fields[i] = field;
+			field = strchr(field, '\t');
+
+			if ( field )
+				*(field++) = 0;
+
+		}
+
+		if ( src->rules == allocated ) {
+
+			struct rule * rules = (struct rule *)realloc(src->policy, ( allocated ? allocated * 2 : 16 ) * sizeof(struct rule));
+
+			if ( ! rules ) {
+
+				fclose(file);
+
+				if ( ! ( flags & QUIET ) )
+					printError(archive, "Cannot load policy", policy, ENOMEM);
+
+				return -1;
+
+			}
+
+			src->policy = rules;
+			allocated = allocated ? allocated * 2 : 16;
+
+		}
+
+		rule = &src->policy[src->rules];
+		memset(rule, 0, sizeof(*rule));
+
+		/* Pattern and compression name are stored in one buffer */
+		len = strlen(fields[0]);
+		rule->pattern = (char *)malloc(len + ( fields[1] ? strlen(fields[1]) : 0 ) + 3);
+
+		if ( ! rule->pattern ) {
+
+			fclose(file);
+
+			if ( ! ( flags & QUIET ) )
+				printError(archive, "Cannot load policy", policy, ENOMEM);
+
+			return -1;
+
+		}
+
+		++src->rules;
+
+		if ( fields[0][0] == '.' )
+			sprintf(rule->pattern, "*%s", fields[0]);
+		else
+			strcpy(rule->pattern, fields[0]);
+
+		if ( fields[1] && fields[1][0] ) {
+
+			char * method = rule->pattern + strlen(rule->pattern) + 1;
+
+			strcpy(method, fields[1]);
+			rule->hasCompression = 1;
+			rule->choose = parseCompression(method, &rule->SFlags, &rule->SCompFlags);
+			rule->method = method;
+
+			if ( rule->choose == -1 )
+				error = 1;
+
+		}
+
+		if ( fields[2] && fields[2][0] ) {
+
+			rule->hasFlags = 1;
+
+			if ( parseFileFlags(fields[2], &rule->fileFlags) == -1 )
+				error = 1;
+
+		}
+
+		if ( error ) {
+
+			fclose(file);
+
+			if ( ! ( flags & QUIET ) ) {
+
+				sprintf(line, "%.900s:%u", policy, lines);
+				printError(archive, "Specified unknown compression method or flags in policy", line, EINVAL);
+
+			}
+
+			return -1;
+
+		}
+
+	}
+
+	fclose(file);
+
+	return 0;
+
+}
+
+/* Apply first matching rule of policy to input file */
+static void applyPolicy(const struct source * src, struct input * in) {
+
+	const char * baseName = in->SFileName;
+	const char * c;
+	unsigned int i;
+
+	for ( c = in->SFileName; *c; ++c )
+		if ( *c == '\\' || *c == '/' )
+			baseName = c + 1;
+
+	for ( i = 0; i < src->rules; ++i ) {
+
+		const struct rule * rule = &src->policy[i];
+
+		if ( ! matchPattern(rule->pattern, strpbrk(rule->pattern, "\\/") ? in->SFileName : baseName) )
+			continue;
+
+		if ( rule->hasCompression ) {
+
+			in->SFlags = ( in->SFlags & ~( MPQ_FILE_COMPRESS | MPQ_FILE_IMPLODE ) ) | rule->SFlags;
+			in->SCompFlags = rule->SCompFlags;
+			in->choose = rule->choose;
+			in->method = rule->choose ? NULL : rule->method;
+
+		}
+
+		if ( rule->hasFlags )
+			in->SFlags = ( in->SFlags & ~FILE_FLAGS ) | rule->fileFlags;
+
+		break;
+
+	}
+
+}
+
+/* Set default settings of input file */
+static void initInput(const struct session * s, struct input * in) {
+
+	in->fileName = in->localName;
+	in->SFileTime = 0;
+	in->fileSize = 0;
+	in->locale = s->locale;
+	in->SFlags = s->SFlags;
+	in->SCompFlags = s->SCompFlags;
+	in->choose = s->choose;
+	in->method = NULL;
+	in->hasMd5 = 0;
+	in->fd = -1;
+	in->data = NULL;
+	in->mapped = 0;
+	in->message = NULL;
+	in->messageFile = NULL;
+	in->errnum = 0;
+
+}
+
+/* Read next line of manifest to input file, return 0 when there are no more lines */
+static int nextManifestInput(const struct session * s, struct source * src, struct input * in) {
+
+	char line[4096];
+
+	while ( fgets(line, sizeof(line), src->manifest) ) {
+
+		char * fields[5] = { NULL, NULL, NULL, NULL, NULL };
+		char * field = line;
+		size_t len = strlen(line);
+		unsigned int i;
+
+		++src->line;
+		initInput(s, in);
+
+		if ( len > 0 && line[len-1] == '\n' ) {
+
+			line[--len] = 0;
+
+		} else if ( ! feof(src->manifest) ) {
+
+			int c;
+
+			while ( ( c = fgetc(src->manifest) ) != EOF && c != '\n' );
+
+			sprintf(in->localName, "%.900s:%u", src->manifestName, src->line);
+			in->message = "Too long line in manifest";
+			in->messageFile = in->localName;
+			in->errnum = EINVAL;
+			return 1;
+
+		}
+
+		if ( len > 0 && line[len-1] == '\r' )
+			line[--len] = 0;
+
+		if ( line[0] == 0 || line[0] == '#' )
+			continue;
+
+		for ( i = 0; i < 5 && field; ++i ) {
+
+			fields[i] = field;
+			field = strchr(field, '\t');
+
+			if ( field )
+				*(field++) = 0;
+
+		}
+
+		if ( strlen(fields[0]) + 1 > 1024 || ( fields[1] && strlen(fields[1]) + 1 > 1024 ) ) {
+
+			sprintf(in->localName, "%.900s:%u", src->manifestName, src->line);
+			in->message = "File has too long path. Cannot create new file";
+			in->messageFile = in->localName;
+			in->errnum = EPERM;
+			return 1;
+
+		}
+
+		strcpy(in->localName, fields[0]);
+
+		if ( fields[1] && fields[1][0] )
+			strcpy(in->SFileName, fields[1]);
+		else
+			toArchivePath(in->SFileName, fields[0]);
+
+		applyPolicy(src, in);
+
+		if ( fields[2] && fields[2][0] ) {
+
+			char * end;
+			unsigned long int locale;
+
+			errno = 0;
+			locale = strtoul(fields[2], &end, 0);
+
+			/* Locale is 16 bit number, decimal or hexadecimal with 0x (e.g. 0x409), names like enUS are not accepted */
+			if ( fields[2][0] < '0' || fields[2][0] > '9' || *end != 0 || errno != 0 || locale > 0xFFFF ) {
+
+				in->message = "Specified invalid locale for file";
+				in->messageFile = in->localName;
+				in->errnum = EINVAL;
+				return 1;
+
+			}
+
+			in->locale = locale;
+
+		}
+
+		if ( fields[3] && fields[3][0] ) {
+
+			in->method = NULL;
+			in->choose = parseCompression(fields[3], &in->SFlags, &in->SCompFlags);
+
+			if ( in->choose == -1 ) {
+
+				in->message = "Specified unknown compression method for file";
+				in->messageFile = in->localName;
+				in->errnum = EINVAL;
+				return 1;
+
+			}
+
+		}
+
+		if ( fields[4] && fields[4][0] && parseFileFlags(fields[4], &in->SFlags) == -1 ) {
+
+			in->message = "Specified unknown flags for file";
+			in->messageFile = in->localName;
+			in->errnum = EINVAL;
+			return 1;
+
+		}
+
+		return 1;
+
+	}
+
+	return 0;
+
+}
+
+/* Take next file of tar or zip archive, its data are already in memory, return 0 when there are no more files */
+static int nextContainerInput(const struct session * s, struct source * src, struct input * in) {
+
+	struct containerEntry entry;
+	int ret = readContainerEntry(src->container, &entry);
+
+	if ( ret != 1 ) {
+
+		/* Archive cannot be read anymore, so error is reported and no more files are taken from it */
+		if ( ret == -1 ) {
+
+			initInput(s, in);
+			sprintf(in->localName, "%.1000s", src->containerName);
+			in->message = src->container->zip ? "Cannot read zip archive" : "Cannot read tar archive";
+			in->messageFile = in->localName;
+			in->errnum = errno;
+
+		}
+
+		if ( src->container->file != stdin )
+			fclose(src->container->file);
+
+		free(src->container);
+		src->container = NULL;
+
+		return ret == -1;
+
+	}
+
+	initInput(s, in);
+
+	strcpy(in->localName, entry.name);
+	toArchivePath(in->SFileName, entry.name);
+	applyPolicy(src, in);
+
+	if ( entry.errnum ) {
+
+		in->message = "Cannot read file";
+		in->messageFile = in->localName;
+		in->errnum = entry.errnum;
+		free(entry.data);
+		return 1;
+
+	}
+
+	in->data = entry.data;
+	in->fileSize = entry.size;
+	toFileTime(&in->SFileTime, entry.mtime);
+
+	return 1;
+
+}
+
+/* Fill name and settings of next input file, return 0 when there are no more files */
+static int nextInput(const struct session * s, struct source * src, struct input * in) {
+
+	if ( src->files && src->files[src->index] ) {
+
+		const char * fileName = src->files[src->index++];
+
+		initInput(s, in);
+
+		if ( strlen(fileName) + 1 > 1024 ) {
+
+			in->message = "File has too long path. Cannot create new file";
+			in->messageFile = fileName;
+			in->errnum = EPERM;
+			return 1;
+
+		}
+
+		strcpy(in->localName, fileName);
+		toArchivePath(in->SFileName, fileName);
+		applyPolicy(src, in);
+
+		return 1;
+
+	}
+
+	if ( src->manifest && nextManifestInput(s, src, in) )
+		return 1;
+
+	if ( src->container )
+		return nextContainerInput(s, src, in);
+
+	return 0;
+
+}
+
+/* Close manifest and container and free policy of source */
+static void closeSource(struct source * src) {
+
+	unsigned int i;
+
+	if ( src->manifest && src->manifest != stdin )
+		fclose(src->manifest);
+
+	src->manifest = NULL;
+
+	if ( src->container && src->container->file && src->container->file != stdin )
+		fclose(src->container->file);
+
+	free(src->container);
+	src->container = NULL;
+
+	for ( i = 0; i < src->rules; ++i )
+		free(src->policy[i].pattern);
+
+	free(src->policy);
+	src->policy = NULL;
+	src->rules = 0;
+
+}
+
+/* Count input files in source, return 0 if it is not possible */
+static unsigned int countInputs(struct source * src) {
+
+	unsigned int count = 0;
+	long int start;
+
+	if ( src->files )
+		for ( ; src->files[count]; ++count );
+
+	if ( src->manifest ) {
+
+		char line[4096];
+		int newLine = 1;
+
+		if ( ( start = ftell(src->manifest) ) == -1 )
+			return 0;
+
+		while ( fgets(line, sizeof(line), src->manifest) ) {
+
+			if ( newLine && line[0] != '\n' && line[0] != '\r' && line[0] != '#' )
+				++count;
+
+			newLine = ( strchr(line, '\n') != NULL );
+
+		}
+
+		if ( fseek(src->manifest, start, SEEK_SET) != 0 )
+			return 0;
+
+	}
+
+	return count;
+
+}
+
+/* Compute MD5 of input file data */
+static void hashInput(struct input * in) {
+
+	struct md5 ctx;
+
+	md5Init(&ctx);
+
+	if ( in->data ) {
+
+		md5Update(&ctx, in->data, in->fileSize);
+
+	} else {
+
+		unsigned char buffer[0x10000];
+		size_t done = 0;
+
+		while ( done < in->fileSize ) {
+
+			ssize_t bytes = readInput(in->fd, buffer, sizeof(buffer));
+
+			if ( bytes <= 0 ) {
+
+				lseek(in->fd, 0, SEEK_SET);
+				return;
+
+			}
+
+			md5Update(&ctx, buffer, bytes);
+			done += bytes;
+
+		}
+
+		lseek(in->fd, 0, SEEK_SET);
+
+	}
+
+	md5Final(&ctx, in->md5);
+	in->hasMd5 = 1;
+
+}
+
+/* Open, stat and (if it is small) read local input file, return -1 on error */
+static int readInputFile(const struct session * s, struct input * in) {
+
+	struct stat st;
+	const char * fileName = in->fileName;
+
+	in->fd = open(fileName, O_RDONLY | O_BINARY);
+
+	if ( in->fd == -1 ) {
+
+		in->message = "Cannot open file";
+		in->messageFile = fileName;
+		in->errnum = errno;
+		return -1;
+
+	}
+
+	if ( fstat(in->fd, &st) == -1 ) {
+
+		in->message = "Cannot stat file";
+		in->messageFile = fileName;
+		in->errnum = errno;
+
+		close(in->fd);
+		in->fd = -1;
+		return -1;
+
+	}
+
+	if ( S_ISDIR(st.st_mode) ) {
+
+		in->message = "Cannot open file";
+		in->messageFile = fileName;
+		in->errnum = EISDIR;
+
+		close(in->fd);
+		in->fd = -1;
+		return -1;
+
+	}
+
+	toFileTime(&in->SFileTime, st.st_mtime);
+
+	if ( S_ISREG(st.st_mode) ) {
+
+		in->fileSize = st.st_size;
+
+#ifdef HAVE_MMAP
+		/* Regular files are mapped to memory and StormLib reads sectors directly from mapping without copying */
+		if ( in->fileSize > 0 && (off_t)in->fileSize == st.st_size ) {
+
+			void * map = mmap(NULL, in->fileSize, PROT_READ, MAP_PRIVATE, in->fd, 0);
+
+			if ( map != MAP_FAILED ) {
+
+				madvise(map, in->fileSize, MADV_SEQUENTIAL);
+
+				if ( s->options->jobs > 1 )
+					madvise(map, in->fileSize, MADV_WILLNEED);
+
+				in->data = (unsigned char *)map;
+				in->mapped = 1;
+
+			}
+
+		}
+#endif
+
+#ifdef POSIX_FADV_SEQUENTIAL
+		if ( ! in->mapped )
+			posix_fadvise(in->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+		if ( ! in->mapped && in->fileSize <= PRELOAD_MAX ) {
+
+			in->data = (unsigned char *)malloc(in->fileSize ? in->fileSize : 1);
+
+			if ( in->data && readInput(in->fd, in->data, in->fileSize) != (ssize_t)in->fileSize ) {
+
+				free(in->data);
+				in->data = NULL;
+				lseek(in->fd, 0, SEEK_SET);
+
+			}
+
+		}
+
+	} else {
+
+		/* Size of pipes and special files is not known before reading, but it is needed for creating file in archive */
+		size_t allocated = 0;
+
+		while ( 1 ) {
+
+			ssize_t bytes;
+
+			if ( in->fileSize == allocated ) {
+
+				unsigned char * data = (unsigned char *)realloc(in->data, allocated ? allocated * 2 : STREAM_BUFFER);
+
+				if ( ! data ) {
+
+					in->message = "Cannot read file";
+					in->messageFile = fileName;
+					in->errnum = ENOMEM;
+					return -1;
+
+				}
+
+				in->data = data;
+				allocated = allocated ? allocated * 2 : STREAM_BUFFER;
+
+			}
+
+			bytes = readInput(in->fd, in->data + in->fileSize, allocated - in->fileSize);
+
+			if ( bytes < 0 ) {
+
+				in->message = "Cannot read file";
+				in->messageFile = fileName;
+				in->errnum = errno;
+				return -1;
+
+			}
+
+			if ( bytes == 0 )
+				break;
+
+			in->fileSize += bytes;
+
+		}
+
+	}
+
+	if ( in->data && ! in->mapped ) {
+
+		close(in->fd);
+		in->fd = -1;
+
+	}
+
+	return 0;
+
+}
+
+/* Check name and read input file. Errors are only stored, writer prints them in order */
+static void prepareInput(const struct session * s, struct input * in) {
+
+	if ( in->message )
+		return;
+
+	if ( strlen(in->SFileName) == 16 && strncasecmp(in->SFileName, "File", 4) == 0 && in->SFileName[12] == '.' ) {
+
+		in->message = "File with mask `File????????.???\' is not allowed. Cannot create new file";
+		in->messageFile = in->SFileName;
+		in->errnum = EPERM;
+		return;
+
+	}
+
+	if ( strcmp(in->SFileName, "(listfile)") == 0 || strcmp(in->SFileName, "(signature)") == 0 || strcmp(in->SFileName, "(attributes)") == 0 || strstr(in->SFileName, "(patch_metadata)") != NULL ) {
+
+		in->message = "Files `(listfile)' `(signature)' `(attributes)' `(patch_metadata)' are for internal usage. Cannot create new file";
+		in->messageFile = in->SFileName;
+		in->errnum = EPERM;
+		return;
+
+	}
+
+	/* Files from tar or zip archive are already in memory */
+	if ( ! in->data && readInputFile(s, in) == -1 )
+		return;
+
+	/* Small file is stored as single unit, one compressed block without sector offset table */
+	if ( in->fileSize <= s->options->singleUnitThreshold && s->options->singleUnitThreshold != 0 && ! ( in->SFlags & MPQ_FILE_ENCRYPTED ) )
+		in->SFlags |= MPQ_FILE_SINGLE_UNIT;
+
+	if ( in->choose )
+		chooseCompression(s, in);
+
+	if ( s->flags & UPDATE )
+		hashInput(in);
+	else if ( ( s->flags & ENTROPY_CHECK ) && ! in->choose && ( in->SFlags & ( MPQ_FILE_COMPRESS | MPQ_FILE_IMPLODE ) ) && ! ( in->SCompFlags & ( MPQ_COMPRESSION_ADPCM_MONO | MPQ_COMPRESSION_ADPCM_STEREO ) ) )
+		checkEntropy(s, in);
+
+}
+
+/* Release resources of input file */
+static void releaseInput(struct input * in) {
+
+#ifdef HAVE_MMAP
+	if ( in->mapped )
+		munmap(in->data, in->fileSize);
+	else
+#endif
+		free(in->data);
+
+	if ( in->fd != -1 )
+		close(in->fd);
+
+	in->fd = -1;
+	in->data = NULL;
+	in->mapped = 0;
+
+}
+
+/* Write data of input file to archive, first sector of file is never compressed by lossy ADPCM compression */
+static int writeInput(const struct session * s, HANDLE SFile, const unsigned char * data, size_t size, unsigned int SCompFlags, unsigned long long int * position) {
+
+	if ( ( SCompFlags & ( MPQ_COMPRESSION_ADPCM_MONO | MPQ_COMPRESSION_ADPCM_STEREO ) ) && *position < s->sectorSize && size > 0 ) {
+
+		size_t first = s->sectorSize - *position;
+
+		if ( first > size )
+			first = size;
+
+		if ( ! SFileWriteFile(SFile, data, first, MPQ_COMPRESSION_PKWARE) )
+			return 0;
+
+		*position += first;
+		data += first;
+		size -= first;
+
+	}
+
+	*position += size;
+
+	return SFileWriteFile(SFile, data, size, SCompFlags);
+
+}
+
+/* Create new archive with same settings as SFileCreateArchive, but with specified sector size (0 - default) */
+static int createArchive(const char * archive, unsigned int SOpenFlags, unsigned int maxFileCount, unsigned int sectorSize, HANDLE * SArchive) {
+
+	SFILE_CREATE_MPQ create;
+
+	if ( sectorSize == 0 )
+		return SFileCreateArchive(archive, SOpenFlags, maxFileCount, SArchive);
+
+	memset(&create, 0, sizeof(create));
+	create.cbSize = sizeof(create);
+	create.dwMpqVersion = ( SOpenFlags & MPQ_CREATE_ARCHIVE_VMASK ) >> FLAGS_TO_FORMAT_SHIFT;
+	create.dwStreamFlags = STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE;
+	create.dwFileFlags1 = ( SOpenFlags & MPQ_CREATE_LISTFILE ) ? MPQ_FILE_DEFAULT_INTERNAL : 0;
+	create.dwFileFlags2 = ( SOpenFlags & MPQ_CREATE_ATTRIBUTES ) ? MPQ_FILE_DEFAULT_INTERNAL : 0;
+	create.dwAttrFlags = ( SOpenFlags & MPQ_CREATE_ATTRIBUTES ) ? ( MPQ_ATTRIBUTE_CRC32 | MPQ_ATTRIBUTE_FILETIME | MPQ_ATTRIBUTE_MD5 ) : 0;
+	create.dwSectorSize = sectorSize;
+	create.dwRawChunkSize = ( create.dwMpqVersion >= MPQ_FORMAT_VERSION_4 ) ? 0x4000 : 0;
+	create.dwMaxFileCount = maxFileCount;
+
+	return SFileCreateArchive2(archive, &create, SArchive);
+
+}
+
+/* Flush archive tables, files written before are not lost when process is interrupted */
+static void commitArchive(struct session * s) {
+
+	if ( s->flags & VERBOSE )
+		printVerbose(s->archive, "Commit archive", s->archive);
+
+	SFileFlushArchive(s->SArchive);
+
+	s->uncommittedFiles = 0;
+	s->uncommittedBytes = 0;
+	++s->commits;
+
+}
+
+/* When archive is full (number of files is not known before appending), double maximum file count and create file again */
+static int growArchive(struct session * s, struct input * in, HANDLE * SFile) {
+
+	unsigned int maxFileCount;
+
+	if ( GetLastError() != ERROR_DISK_FULL )
+		return 0;
+
+	if ( ! SFileGetFileInfo(s->SArchive, SFileMpqMaxFileCount, &maxFileCount, sizeof(maxFileCount), 0) )
+		return 0;
+
+	if ( s->flags & VERBOSE )
+		printVerbose(s->archive, "Change maximum file count", s->archive);
+
+	if ( ! SFileSetMaxFileCount(s->SArchive, maxFileCount * 2) )
+		return 0;
+
+	return SFileCreateFile(s->SArchive, in->SFileName, in->SFileTime, in->fileSize, in->locale, in->SFlags, SFile);
+
+}
+
+/**
+ * Check if input file is already in archive with same content
+ *
+ * File must exist with same locale and size. If archive has MD5 of file in attributes, it must be same as MD5 of input file,
+ * otherwise time of file must be same. Return 1 if file is unchanged, 0 if it is new and -1 if it is changed.
+ */
+static int unchangedInput(struct session * s, struct input * in) {
+
+	static const unsigned char noMd5[16] = { 0 };
+
+	HANDLE SFile = NULL;
+	TFileEntry entry;
+	unsigned int locale = 0;
+	int found;
+
+	SFileSetLocale(in->locale);
+	found = SFileOpenFileEx(s->SArchive, in->SFileName, SFILE_OPEN_FROM_MPQ, &SFile);
+	SFileSetLocale(s->locale);
+
+	if ( ! found )
+		return 0;
+
+	found = SFileGetFileInfo(SFile, SFileInfoFileEntry, &entry, sizeof(entry), NULL) && SFileGetFileInfo(SFile, SFileInfoLocale, &locale, sizeof(locale), NULL);
+	SFileCloseFile(SFile);
+
+	/* StormLib opens file with neutral locale when there is no file with requested locale */
+	if ( ! found || locale != in->locale )
+		return 0;
+
+	if ( entry.dwFileSize != in->fileSize )
+		return -1;
+
+	if ( in->hasMd5 && memcmp(entry.md5, noMd5, sizeof(noMd5)) != 0 )
+		return memcmp(entry.md5, in->md5, sizeof(in->md5)) == 0 ? 1 : -1;
+
+	if ( entry.FileTime != 0 && entry.FileTime == in->SFileTime )
+		return 1;
+
+	return -1;
+
+}
+
+/* Write prepared input file to archive */
+static void commitInput(struct session * s, struct input * in) {
+
+	HANDLE SFile = NULL;
+	HANDLE SArchive = s->SArchive;
+	const char * archive = s->archive;
+	unsigned int flags = s->flags;
+	unsigned long long int position = 0;
+
+	if ( in->message ) {
+
+		if ( ! ( flags & QUIET ) )
+			printError(archive, in->message, in->messageFile, in->errnum);
+
+		return;
+
+	}
+
+	if ( flags & UPDATE ) {
+
+		int unchanged = unchangedInput(s, in);
+
+		if ( unchanged == 1 ) {
+
+			if ( flags & VERBOSE )
+				printVerbose(archive, "Skip unchanged file", in->SFileName);
+
+			++s->skippedFiles;
+			s->skippedBytes += in->fileSize;
+			return;
+
+		}
+
+		if ( unchanged == -1 )
+			++s->replacedFiles;
+
+	}
+
+	if ( flags & VERBOSE )
+		printVerbose(archive, "Append file", in->SFileName);
+
+	if ( ( flags & VERBOSE ) && in->method ) {
+
+		char message[64];
+		sprintf(message, "Use compression %s for file", in->method);
+		printVerbose(archive, message, in->SFileName);
+
+	}
+
+	if ( ! SFileCreateFile(SArchive, in->SFileName, in->SFileTime, in->fileSize, in->locale, in->SFlags, &SFile) && ! growArchive(s, in, &SFile) ) {
+
+		if ( ! ( flags & QUIET ) )
+			printError(archive, "Cannot create new file", in->SFileName, GetLastError());
+
+		return;
+
+	}
+
+	if ( in->data ) {
+
+		if ( ! writeInput(s, SFile, in->data, in->fileSize, in->SCompFlags, &position) )
+			if ( ! ( flags & QUIET ) )
+				printError(archive, "Cannot write file new", in->SFileName, GetLastError());
+
+	} else {
+
+		/* Big reads aligned to sector size, so StormLib does not need to join sectors from more reads */
+		size_t bufferSize = STREAM_BUFFER - STREAM_BUFFER % s->sectorSize;
+		unsigned char * buffer = (unsigned char *)malloc(bufferSize);
+		size_t done = 0;
+
+		if ( ! buffer ) {
+
+			if ( ! ( flags & QUIET ) )
+				printError(archive, "Cannot read file", in->fileName, ENOMEM);
+
+		}
+
+		while ( buffer && done < in->fileSize ) {
+
+			ssize_t bytes = readInput(in->fd, buffer, in->fileSize - done < bufferSize ? in->fileSize - done : bufferSize);
+
+			if ( bytes <= 0 ) {
+
+				if ( ! ( flags & QUIET ) )
+					printError(archive, "Cannot read file", in->fileName, bytes < 0 ? errno : EIO);
+
+				break;
+
+			}
+
+			if ( ! writeInput(s, SFile, buffer, bytes, in->SCompFlags, &position) ) {
+
+				if ( ! ( flags & QUIET ) )
+					printError(archive, "Cannot write file new", in->SFileName, GetLastError());
+
+				break;
+
+			}
+
+			done += bytes;
+
+		}
+
+		free(buffer);
+
+	}
+
+	SFileFinishFile(SFile);
+
+	++s->uncommittedFiles;
+	s->uncommittedBytes += in->fileSize;
+
+	if ( s->uncommittedFiles > s->maxUncommittedFiles )
+		s->maxUncommittedFiles = s->uncommittedFiles;
+
+	if ( s->uncommittedBytes > s->maxUncommittedBytes )
+		s->maxUncommittedBytes = s->uncommittedBytes;
+
+	if ( ( s->options->commitFiles != 0 && s->uncommittedFiles >= s->options->commitFiles ) || ( s->options->commitBytes != 0 && s->uncommittedBytes >= s->options->commitBytes ) )
+		commitArchive(s);
+
+}
+
+#ifdef HAVE_PTHREAD
+
+/* Shared state of read-ahead threads which prepare input files */
+struct queue {
+
+	struct session * s;
+	struct source * src;
+
+	struct input * inputs;
+	unsigned int window;
+
+	unsigned int next;
+	unsigned int committed;
+	int end;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+};
+
+static void * readAheadWorker(void * arg) {
+
+	struct queue * q = (struct queue *)arg;
+
+	pthread_mutex_lock(&q->mutex);
+
+	while ( 1 ) {
+
+		struct input * in;
+
+		while ( ! q->end && q->next >= q->committed + q->window )
+			pthread_cond_wait(&q->cond, &q->mutex);
+
+		if ( q->end )
+			break;
+
+		in = &q->inputs[q->next % q->window];
+
+		/* Source is read only under lock, so order of inputs is same as order of slots */
+		if ( ! nextInput(q->s, q->src, in) ) {
+
+			q->end = 1;
+			pthread_cond_broadcast(&q->cond);
+			break;
+
+		}
+
+		++q->next;
+
+		pthread_mutex_unlock(&q->mutex);
+		prepareInput(q->s, in);
+		pthread_mutex_lock(&q->mutex);
+
+		in->ready = 1;
+		pthread_cond_broadcast(&q->cond);
+
+	}
+
+	pthread_mutex_unlock(&q->mutex);
+
+	return NULL;
+
+}
+
+/* Prepare input files in read-ahead threads and commit them in current thread in same order as specified */
+static int appendReadAhead(struct session * s, struct source * src, unsigned int jobs) {
+
+	struct queue q;
+	pthread_t * threads;
+	unsigned int i, started;
+
+	q.s = s;
+	q.src = src;
+	q.window = jobs * 2;
+	q.next = 0;
+	q.committed = 0;
+	q.end = 0;
+
+	q.inputs = (struct input *)calloc(q.window, sizeof(struct input));
+	threads = (pthread_t *)calloc(jobs, sizeof(pthread_t));
+
+	if ( ! q.inputs || ! threads ) {
+
+		free(q.inputs);
+		free(threads);
+		return -1;
+
+	}
+
+	pthread_mutex_init(&q.mutex, NULL);
+	pthread_cond_init(&q.cond, NULL);
 
-int smpq_append(const char * archive, const char * const files[], unsigned int flags, unsigned int locale, unsigned int maxFileCount, const char * compression) {
+	for ( started = 0; started < jobs; ++started )
+		if ( pthread_create(&threads[started], NULL, readAheadWorker, &q) != 0 )
+			break;
+
+	if ( started == 0 ) {
+
+		pthread_cond_destroy(&q.cond);
+		pthread_mutex_destroy(&q.mutex);
+		free(q.inputs);
+		free(threads);
+		return -1;
+
+	}
+
+	for ( i = 0; ; ++i ) {
+
+		struct input * in = &q.inputs[i % q.window];
+
+		pthread_mutex_lock(&q.mutex);
+
+		while ( ! in->ready && ! ( q.end && i >= q.next ) )
+			pthread_cond_wait(&q.cond, &q.mutex);
+
+		pthread_mutex_unlock(&q.mutex);
+
+		if ( ! in->ready )
+			break;
+
+		commitInput(s, in);
+		releaseInput(in);
+
+		pthread_mutex_lock(&q.mutex);
+		in->ready = 0;
+		q.committed = i + 1;
+		pthread_cond_broadcast(&q.cond);
+		pthread_mutex_unlock(&q.mutex);
+
+	}
+
+	for ( i = 0; i < started; ++i )
+		pthread_join(threads[i], NULL);
+
+	pthread_cond_destroy(&q.cond);
+	pthread_mutex_destroy(&q.mutex);
+	free(q.inputs);
+	free(threads);
+
+	return 0;
+
+}
+
+#endif
+
+int smpq_append(const char * archive, const char * const files[], unsigned int flags, unsigned int locale, unsigned int maxFileCount, const char * compression, const struct smpq_options * options) {
 
 	unsigned int SFlags = 0;
 	unsigned int SCompFlags = 0;
+	int choose = 0;
 
-	int i;
+	unsigned int count;
 	HANDLE SArchive = NULL;
+	struct session s;
+	struct source src;
 
 	if ( flags & ENCRYPT )
 		SFlags |= MPQ_FILE_ENCRYPTED;
@@ -54,75 +1734,103 @@ int smpq_append(const char * archive, const char * const files[], unsigned int f
 	if ( flags & SINGLE_UNIT )
 		SFlags |= MPQ_FILE_SINGLE_UNIT;
 
-	if ( flags & OVERWRITE )
+	if ( flags & ( OVERWRITE | UPDATE ) )
 		SFlags |= MPQ_FILE_REPLACEEXISTING;
 
 	if ( compression != NULL ) {
 
-		if ( strcmp(compression, "none") == 0 ) {
+		choose = parseCompression(compression, &SFlags, &SCompFlags);
 
-		} else if ( strcasecmp(compression, "IMPLODE") == 0 ) {
+		if ( choose == -1 ) {
 
-			SFlags |= MPQ_FILE_IMPLODE;
+			if ( ! ( flags & QUIET ) )
+				printError(archive, "Specified unknown compression method", compression, EINVAL);
 
-		} else {
+			return -1;
 
-			SFlags |= MPQ_FILE_COMPRESS;
-
-			if ( strcasecmp(compression, "HUFFMANN") == 0 )
-				SCompFlags |= MPQ_COMPRESSION_HUFFMANN;
-			else if ( strcasecmp(compression, "ADPCM_MONO") == 0 )
-				SCompFlags |= MPQ_COMPRESSION_ADPCM_MONO;
-			else if ( strcasecmp(compression, "ADPCM_STEREO") == 0 )
-				SCompFlags |= MPQ_COMPRESSION_ADPCM_STEREO;
-			else if ( strcasecmp(compression, "ZLIB") == 0 )
-				SCompFlags |= MPQ_COMPRESSION_ZLIB;
-			else if ( strcasecmp(compression, "PKWARE") == 0 )
-				SCompFlags |= MPQ_COMPRESSION_PKWARE;
-			else if ( strcasecmp(compression, "BZIP2") == 0 )
-				SCompFlags |= MPQ_COMPRESSION_BZIP2;
-			else if ( strcasecmp(compression, "SPARSE") == 0 )
-				SCompFlags |= MPQ_COMPRESSION_SPARSE;
-			else if ( strcasecmp(compression, "LZMA") == 0 )
-				SCompFlags |= MPQ_COMPRESSION_LZMA;
-			else if ( strcasecmp(compression, "HUFFMANN+ADPCM_MONO") == 0 )
-				SCompFlags |= MPQ_COMPRESSION_HUFFMANN | MPQ_COMPRESSION_ADPCM_MONO;
-			else if ( strcasecmp(compression, "HUFFMANN+ADPCM_STEREO") == 0 )
-				SCompFlags |= MPQ_COMPRESSION_HUFFMANN | MPQ_COMPRESSION_ADPCM_STEREO;
-			else if ( strcasecmp(compression, "ZLIB+PKWARE") == 0 )
-				SCompFlags |= MPQ_COMPRESSION_ZLIB | MPQ_COMPRESSION_PKWARE;
-			else if ( strcasecmp(compression, "BZIP2+PKWARE") == 0 )
-				SCompFlags |= MPQ_COMPRESSION_BZIP2 | MPQ_COMPRESSION_PKWARE;
-			else if ( strcasecmp(compression, "SPARSE+ZLIB") == 0 )
-				SCompFlags |= MPQ_COMPRESSION_SPARSE | MPQ_COMPRESSION_ZLIB;
-			else if ( strcasecmp(compression, "SPARSE+PKWARE") == 0 )
-				SCompFlags |= MPQ_COMPRESSION_SPARSE | MPQ_COMPRESSION_PKWARE;
-			else if ( strcasecmp(compression, "SPARSE+BZIP2") == 0 )
-				SCompFlags |= MPQ_COMPRESSION_SPARSE | MPQ_COMPRESSION_BZIP2;
-			else if ( strcasecmp(compression, "SPARSE+ZLIB+PKWARE") == 0 )
-				SCompFlags |= MPQ_COMPRESSION_SPARSE | MPQ_COMPRESSION_ZLIB | MPQ_COMPRESSION_PKWARE;
-			else if ( strcasecmp(compression, "SPARSE+BZIP2+PKWARE") == 0 )
-				SCompFlags |= MPQ_COMPRESSION_SPARSE | MPQ_COMPRESSION_BZIP2 | MPQ_COMPRESSION_PKWARE;
-			else if ( strcasecmp(compression, "choose") == 0 ) {
+		}
 
-				if ( ! ( flags & QUIET ) )
-					printError(archive, "Choose the best compression is not implemented yet", compression, EINVAL);
+	}
 
-				return -1;
+	src.files = files;
+	src.index = 0;
+	src.manifest = NULL;
+	src.manifestName = options->manifest;
+	src.line = 0;
+	src.policy = NULL;
+	src.rules = 0;
+	src.container = NULL;
+	src.containerName = options->fromTar ? options->fromTar : options->fromZip;
 
-			} else {
+	if ( options->policy && loadPolicy(archive, flags, &src, options->policy) == -1 ) {
 
-				if ( ! ( flags & QUIET ) )
-					printError(archive, "Specified unknown compression method", compression, EINVAL);
+		closeSource(&src);
+		return -1;
 
-				return -1;
+	}
 
-			}
+	if ( options->manifest ) {
+
+		if ( strcmp(options->manifest, "-") == 0 )
+			src.manifest = stdin;
+		else
+			src.manifest = fopen(options->manifest, "r");
+
+		if ( ! src.manifest ) {
+
+			if ( ! ( flags & QUIET ) )
+				printError(archive, "Cannot open manifest", options->manifest, errno);
+
+			closeSource(&src);
+			return -1;
+
+		}
+
+	}
+
+	if ( src.containerName ) {
+
+		src.container = (struct container *)malloc(sizeof(struct container));
+
+		if ( ! src.container ) {
+
+			if ( ! ( flags & QUIET ) )
+				printError(archive, "Cannot open archive", src.containerName, ENOMEM);
+
+			closeSource(&src);
+			return -1;
+
+		}
+
+		src.container->zip = ( options->fromTar == NULL );
+		src.container->start = 0;
+		src.container->end = 0;
+
+		if ( strcmp(src.containerName, "-") == 0 )
+			src.container->file = stdin;
+		else
+			src.container->file = fopen(src.containerName, "rb");
+
+		if ( ! src.container->file ) {
+
+			if ( ! ( flags & QUIET ) )
+				printError(archive, "Cannot open archive", src.containerName, errno);
+
+			closeSource(&src);
+			return -1;
 
 		}
 
+#if defined(WIN32) || defined(_MSC_VER)
+		if ( src.container->file == stdin )
+			_setmode(_fileno(stdin), _O_BINARY);
+#endif
+
 	}
 
+	/* Files in container are not counted, archive grows when they do not fit */
+	count = countInputs(&src);
+
 	if ( flags & CREATE ) {
 
 		struct stat st;
@@ -138,6 +1846,7 @@ int smpq_append(const char * archive, const char * const files[], unsigned int f
 				if ( ! ( flags & QUIET ) )
 					printError(archive, "Cannot remove existing archive", archive, errno);
 
+				closeSource(&src);
 				return -1;
 
 			}
@@ -160,17 +1869,17 @@ int smpq_append(const char * archive, const char * const files[], unsigned int f
 			SOpenFlags |= MPQ_CREATE_ATTRIBUTES;
 
 		if ( maxFileCount == 0 )
-			for ( i = 0; files[i]; ++i )
-				++maxFileCount;
+			maxFileCount = planCapacity(count, ! ( flags & ( MPQ_VERSION_1 | MPQ_VERSION_2 ) ), options);
 
 		if ( maxFileCount < 4 )
 			maxFileCount = 4;
 
-		if ( ! SFileCreateArchive(archive, SOpenFlags, maxFileCount, &SArchive) ) {
+		if ( ! createArchive(archive, SOpenFlags, maxFileCount, options->sectorSize, &SArchive) ) {
 
 			if ( ! ( flags & QUIET ) )
 				printError(archive, "Cannot create archive", archive, GetLastError());
 
+			closeSource(&src);
 			return -1;
 
 		}
@@ -193,6 +1902,7 @@ int smpq_append(const char * archive, const char * const files[], unsigned int f
 			if ( ! ( flags & QUIET ) )
 				printError(archive, "Cannot open archive", archive, GetLastError());
 
+			closeSource(&src);
 			return -1;
 
 		}
@@ -200,19 +1910,20 @@ int smpq_append(const char * archive, const char * const files[], unsigned int f
 		if ( maxFileCount == 0 ) {
 
 			unsigned int fileCount;
+			unsigned int currentMaxFileCount;
 
 			if ( ! SFileGetFileInfo(SArchive, SFileMpqNumberOfFiles, &fileCount, sizeof(fileCount), 0) )
 				fileCount = 0;
 
-			for ( i = 0; files[i]; ++i )
-				++fileCount;
+			fileCount += count;
 
-			if ( ! SFileGetFileInfo(SArchive, SFileMpqMaxFileCount, &maxFileCount, sizeof(maxFileCount), 0) )
-				maxFileCount = 0;
+			if ( ! SFileGetFileInfo(SArchive, SFileMpqMaxFileCount, &currentMaxFileCount, sizeof(currentMaxFileCount), 0) )
+				currentMaxFileCount = 0;
 
-			if ( maxFileCount < fileCount )
-				maxFileCount = fileCount;
-			else
+			/* Appending never shrinks hash table */
+			maxFileCount = resizeCapacity(fileCount, currentMaxFileCount, hasHetTable(SArchive), options);
+
+			if ( maxFileCount < currentMaxFileCount )
 				maxFileCount = 0;
 
 		}
@@ -228,6 +1939,7 @@ int smpq_append(const char * archive, const char * const files[], unsigned int f
 					printError(archive, "Cannot change maximum file count", archive, GetLastError());
 
 				SFileCloseArchive(SArchive);
+				closeSource(&src);
 				return -1;
 
 			}
@@ -238,123 +1950,88 @@ int smpq_append(const char * archive, const char * const files[], unsigned int f
 
 	SFileSetLocale(locale);
 
-	for ( i = 0; files[i]; ++i ) {
-
-		struct stat st;
-		FILE * file = NULL;
-		const char * fileName = files[i];
-		size_t fileSize = 0;
-
-		HANDLE SFile = NULL;
-		char SFileName[1024];
-		unsigned long long int SFileTime = 0;
-
-		char buffer[0x10000];
-		size_t bytes = 0;
-
-		if ( strlen(fileName) + 1 > 1024 ) {
-
-			if ( ! ( flags & QUIET ) )
-				printError(archive, "File `%s' has too long path. Cannot create new file", SFileName, EPERM);
-
-			continue;
-
-		}
-
-		toArchivePath(SFileName, fileName);
-
-		if ( strlen(SFileName) == 16 && strncasecmp(SFileName, "File", 4) == 0 && SFileName[12] == '.' ) {
-
-			if ( ! ( flags & QUIET ) )
-				printError(archive, "File with mask `File????????.???\' is not allowed. Cannot create new file", SFileName, EPERM);
-
-			continue;
-
-		}
-
-		if ( strcmp(SFileName, "(listfile)") == 0 || strcmp(SFileName, "(signature)") == 0 || strcmp(SFileName, "(attributes)") == 0 || strstr(SFileName, "(patch_metadata)") != NULL ) {
-
-			if ( ! ( flags & QUIET ) )
-				printError(archive, "Files `(listfile)' `(signature)' `(attributes)' `(patch_metadata)' are for internal usage. Cannot create new file", SFileName, EPERM);
-
-			continue;
-
-		}
-
-		file = fopen(fileName, "rb");
-
-		if ( ! file ) {
-
-			if ( ! ( flags & QUIET ) )
-				printError(archive, "Cannot open file", fileName, errno);
-
-			continue;
-
-		}
-
-		fseek(file, 0, SEEK_END);
-		fileSize = ftell(file);
-		rewind(file);
+	s.SArchive = SArchive;
+	s.archive = archive;
+	s.flags = flags;
+	s.locale = locale;
+	s.SFlags = SFlags;
+	s.SCompFlags = SCompFlags;
+	s.choose = choose;
+	s.options = options;
+	s.uncommittedFiles = 0;
+	s.uncommittedBytes = 0;
+	s.maxUncommittedFiles = 0;
+	s.maxUncommittedBytes = 0;
+	s.commits = 0;
+	s.skippedFiles = 0;
+	s.skippedBytes = 0;
+	s.replacedFiles = 0;
+
+
+	if ( ! SFileGetFileInfo(SArchive, SFileMpqSectorSize, &s.sectorSize, sizeof(s.sectorSize), 0) || s.sectorSize == 0 )
+		s.sectorSize = 0x1000;
+
+#ifdef HAVE_PTHREAD
+	if ( options->jobs > 1 && count != 1 ) {
 
 		if ( flags & VERBOSE )
-			printVerbose(archive, "Append file", SFileName);
-
-		if ( stat(fileName, &st) == -1 ) {
+			printVerbose(archive, "Use read-ahead threads for reading files", archive);
 
-			if ( ! ( flags & QUIET ) )
-				printError(archive, "Cannot stat file", fileName, errno);
+		appendReadAhead(&s, &src, options->jobs);
 
-			fclose(file);
-			continue;
+	}
+#endif
 
-		}
+	while ( 1 ) {
 
-		toFileTime(&SFileTime, st.st_mtime);
+		struct input in;
 
-		if ( ! SFileCreateFile(SArchive, SFileName, SFileTime, fileSize, locale, SFlags, &SFile) ) {
+		if ( ! nextInput(&s, &src, &in) )
+			break;
 
-			if ( ! ( flags & QUIET ) )
-				printError(archive, "Cannot create new file", SFileName, GetLastError());
+		prepareInput(&s, &in);
+		commitInput(&s, &in);
+		releaseInput(&in);
 
-			fclose(file);
-			continue;
+	}
 
-		}
+	closeSource(&src);
 
-		while ( 1 ) {
+	if ( s.uncommittedFiles != 0 )
+		commitArchive(&s);
 
-			bytes = fread(buffer, 1, sizeof(buffer), file);
+	if ( flags & VERBOSE ) {
 
-			if ( ferror(file) ) {
+		char message[128];
+		sprintf(message, "Committed %u times (at most %u files / %llu bytes uncommitted)", s.commits, s.maxUncommittedFiles, s.maxUncommittedBytes);
+		printVerbose(archive, message, archive);
 
-				if ( ! ( flags & QUIET ) )
-					printError(archive, "Cannot read file", fileName, errno);
+	}
 
-				break;
+	if ( ( flags & UPDATE ) && ( flags & VERBOSE ) ) {
 
-			}
+		char message[128];
+		sprintf(message, "Skipped %u unchanged files (%llu bytes), replaced %u changed files", s.skippedFiles, s.skippedBytes, s.replacedFiles);
+		printVerbose(archive, message, archive);
 
-			if ( ! SFileWriteFile(SFile, buffer, bytes, SCompFlags) ) {
+	}
 
-				if ( ! ( flags & QUIET ) )
-					printError(archive, "Cannot write file new", SFileName, GetLastError());
+	if ( flags & VERBOSE ) {
 
-				break;
+		unsigned int fileCount;
+		char message[256];
 
-			}
+		if ( SFileGetFileInfo(SArchive, SFileMpqNumberOfFiles, &fileCount, sizeof(fileCount), 0) && SFileGetFileInfo(SArchive, SFileMpqMaxFileCount, &maxFileCount, sizeof(maxFileCount), 0) ) {
 
-			if ( feof(file) )
-				break;
+			describeCapacity(message, fileCount, maxFileCount, hasHetTable(SArchive));
+			printVerbose(archive, message, archive);
 
 		}
 
-		fclose(file);
-		SFileFinishFile(SFile);
-		SFileFlushArchive(SArchive);
-
 	}
 
-	if ( flags & OVERWRITE )
+	/* With flag UPDATE archive is compacted only when some file was replaced */
+	if ( ( flags & UPDATE ) ? s.replacedFiles != 0 : ( flags & OVERWRITE ) != 0 )
 		SFileCompactArchive(SArchive, NULL, 0);
 
 	SFileCloseArchive(SArchive);
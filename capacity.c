@@ -0,0 +1,105 @@
+/*
+    capacity.c - StormLib MPQ archiving utility
+    Copyright (C) 2010 - 2016  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <StormLib.h>
+
+#include <stdio.h>
+
+#include "common.h"
+
+/* Number of table slots for maximum file count, StormLib creates HET table with 4/3 slots of maximum file count */
+static unsigned long long int tableSlots(unsigned int maxFileCount, int het) {
+
+	if ( het )
+		return (unsigned long long int)maxFileCount * 4 / 3;
+
+	return maxFileCount;
+
+}
+
+int hasHetTable(void * SArchive) {
+
+	unsigned long long int offset = 0;
+
+	if ( ! SFileGetFileInfo(SArchive, SFileMpqHetTableOffset, &offset, sizeof(offset), NULL) )
+		return 0;
+
+	return offset != 0;
+
+}
+
+unsigned int planCapacity(unsigned int fileCount, int het, const struct smpq_options * options) {
+
+	unsigned long long int needed = (unsigned long long int)fileCount * ( 100 + options->headroom ) / options->loadFactor;
+	unsigned int capacity = 4;
+
+	/* HET table has more slots than maximum file count, so less maximum file count is needed for same load factor */
+	if ( het )
+		needed = needed * 3 / 4;
+
+	if ( needed < fileCount )
+		needed = fileCount;
+
+	while ( capacity < needed && capacity < 0x80000000 )
+		capacity *= 2;
+
+	return capacity;
+
+}
+
+unsigned int resizeCapacity(unsigned int fileCount, unsigned int maxFileCount, int het, const struct smpq_options * options) {
+
+	unsigned int capacity = planCapacity(fileCount, het, options);
+
+	/* Grow when target load factor is crossed */
+	if ( (unsigned long long int)fileCount * 100 > tableSlots(maxFileCount, het) * options->loadFactor )
+		return capacity > maxFileCount ? capacity : 0;
+
+	/* Shrink only when table is four times bigger than needed, so appending and removing few files does not rebuild it again */
+	if ( (unsigned long long int)capacity * 4 <= maxFileCount )
+		return capacity;
+
+	return 0;
+
+}
+
+void describeCapacity(char * buffer, unsigned int fileCount, unsigned int maxFileCount, int het) {
+
+	unsigned long long int slots = tableSlots(maxFileCount, het);
+	unsigned long long int ratio, hit, miss;
+
+	if ( slots == 0 || fileCount >= slots ) {
+
+		sprintf(buffer, "%u files in %llu slots", fileCount, slots);
+		return;
+
+	}
+
+	/* Expected probe length of linear probing with load factor a is (1 + 1/(1-a)) / 2 for hit and (1 + 1/(1-a)^2) / 2 for miss */
+	ratio = slots * 100 / ( slots - fileCount );
+
+	if ( ratio > 1000000000 )
+		ratio = 1000000000;
+
+	hit = ( 100 + ratio ) / 2;
+	miss = ( 100 + ratio * ratio / 100 ) / 2;
+
+	sprintf(buffer, "%u files in %llu slots, load factor %llu%%, expected probe length %llu.%02llu (hit) / %llu.%02llu (miss)", fileCount, slots, fileCount * 100 / slots, hit / 100, hit % 100, miss / 100, miss % 100);
+
+}
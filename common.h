@@ -17,8 +17,10 @@
 
 */
 
+#include <stdio.h>
 #include <time.h>
 #include <limits.h>
+#include <stddef.h>
 
 #if defined(_MSC_VER)
 #define inline __inline
@@ -30,40 +32,50 @@
  * Flags *
  *********/
 
-#define CREATE			1 << 0
-#define LIST			1 << 0
+#define CREATE			( 1 << 0 )
+#define LIST			( 1 << 0 )
 
 /* Options - program */
-#define QUIET			1 << 1
-#define OVERWRITE		1 << 2
-#define VERBOSE			1 << 3
+#define QUIET			( 1 << 1 )
+#define OVERWRITE		( 1 << 2 )
+#define VERBOSE			( 1 << 3 )
 
 /* Options - archive types */
-#define MPQ_VERSION		1 << 4
-#define MPQ_VERSION_1		1 << 5
-#define MPQ_VERSION_2		1 << 6
-#define MPQ_VERSION_3		1 << 7
-#define MPQ_VERSION_4		1 << 8
-#define MPQ_PATCHED		1 << 9
-#define MPQ_PARTIAL		1 << 10
-#define MPQ_ENCRYPTED		1 << 11
-#define MPQ_NOT_ENCRYPTED	1 << 12
+#define MPQ_VERSION		( 1 << 4 )
+#define MPQ_VERSION_1		( 1 << 5 )
+#define MPQ_VERSION_2		( 1 << 6 )
+#define MPQ_VERSION_3		( 1 << 7 )
+#define MPQ_VERSION_4		( 1 << 8 )
+#define MPQ_PATCHED		( 1 << 9 )
+#define MPQ_PARTIAL		( 1 << 10 )
+#define MPQ_ENCRYPTED		( 1 << 11 )
+#define MPQ_NOT_ENCRYPTED	( 1 << 12 )
 
 /* Options - archive open/create */
-#define NO_SYSTEM_LF		1 << 14
-#define NO_LISTFILE		1 << 15
-#define LISTFILE		1 << 16
-#define NO_ATTRIBUTES		1 << 17
-#define SECTOR_CRC		1 << 18
-#define MAX_FILE_COUNT		1 << 19
+#define NO_SYSTEM_LF		( 1 << 14 )
+#define NO_LISTFILE		( 1 << 15 )
+#define LISTFILE		( 1 << 16 )
+#define NO_ATTRIBUTES		( 1 << 17 )
+#define SECTOR_CRC		( 1 << 18 )
+#define MAX_FILE_COUNT		( 1 << 19 )
+
+/* Options - update */
+#define UPDATE			( 1 << 13 )
+#define CHECKSUM		( 1 << 30 )
 
 /* Options - file */
-#define LOCALE			1 << 20
-#define ENCRYPT			1 << 21
-#define FIX_KEY			1 << 22
-#define DELETE_MARKER		1 << 23
-#define SINGLE_UNIT		1 << 24
-#define COMPRESSION		1 << 25
+#define LOCALE			( 1 << 20 )
+#define ENCRYPT			( 1 << 21 )
+#define FIX_KEY			( 1 << 22 )
+#define DELETE_MARKER		( 1 << 23 )
+#define SINGLE_UNIT		( 1 << 24 )
+#define COMPRESSION		( 1 << 25 )
+#define ENTROPY_CHECK		( 1 << 27 )
+
+/* Options - extract */
+#define TO_STDOUT		( 1 << 28 )
+#define FRAMED			( 1 << 29 )
+#define NO_URING		( 1 << 26 )
 
 /* Options - with arguments */
 #define MPQ_VERSION_ARG		1
@@ -71,6 +83,75 @@
 #define MAX_FILE_COUNT_ARG	3
 #define LOCALE_ARG		4
 #define COMPRESSION_ARG		5
+#define JOBS_ARG		6
+#define SAMPLE_SECTORS_ARG	7
+#define DECODE_WEIGHT_ARG	8
+#define MIN_GAIN_ARG		9
+#define COMMIT_FILES_ARG	10
+#define COMMIT_BYTES_ARG	11
+#define MANIFEST_ARG		12
+#define POLICY_ARG		13
+#define HEADROOM_ARG		14
+#define LOAD_FACTOR_ARG		15
+#define SECTOR_SIZE_ARG		16
+#define SINGLE_UNIT_ARG		17
+#define SORT_ARG		18
+#define FORMAT_ARG		19
+#define TAR_ARG			20
+#define FROM_TAR_ARG		21
+#define FROM_ZIP_ARG		22
+#define RANGE_ARG		23
+#define NAMES_ARG		24
+
+/* Keys for sorting list of files */
+#define SORT_NONE		0
+#define SORT_NAME		1
+#define SORT_SIZE		2
+#define SORT_COMPRESSED		3
+#define SORT_RATIO		4
+#define SORT_OFFSET		5
+#define SORT_TIME		6
+
+/* Formats of list of files */
+#define FORMAT_TEXT		0
+#define FORMAT_NDJSON		1
+#define FORMAT_CSV		2
+#define FORMAT_NUL		3
+
+/* Values of options with arguments which are not passed as separate function arguments */
+struct smpq_options {
+
+	unsigned int jobs;		/* Number of worker threads (1 - do not use threads) */
+
+	unsigned int sampleSectors;	/* Number of sectors compressed by compression method choose (0 - whole file) */
+	unsigned int decodeWeight;	/* Cost of one microsecond of estimated decompression in bytes for compression method choose */
+	unsigned int minGain;		/* Minimal saved size in percents, otherwise file is stored without compression */
+
+	unsigned int commitFiles;		/* Flush archive tables after this number of appended files (0 - only at end) */
+	unsigned long long int commitBytes;	/* Flush archive tables after this number of appended bytes (0 - only at end) */
+
+	const char * manifest;		/* File with list of files to append (one file per line) or - for stdin */
+	const char * policy;		/* File with rules for compression and flags of files by name (one rule per line) */
+	const char * fromTar;		/* Tar archive with files to append or - for stdin */
+	const char * fromZip;		/* Zip archive with files to append or - for stdin */
+
+	unsigned int headroom;		/* Additional space for files in percents when maximum file count is changed */
+	unsigned int loadFactor;	/* Maximal ratio of files and hash table slots in percents */
+
+	unsigned int sectorSize;		/* Sector size of new archive (power of two, 0 - StormLib default) */
+	unsigned long long int singleUnitThreshold;	/* Files up to this size are stored as single unit (0 - disabled) */
+
+	unsigned int sort;		/* Key for sorting list of files (SORT_NONE - order of hash table) */
+	unsigned int format;		/* Format of list of files (FORMAT_TEXT - columns for humans) */
+
+	const char * tar;		/* Extract files to this tar archive or - for stdout (NULL - create files) */
+
+	unsigned long long int rangeOffset;	/* Extract only part of each file from this offset */
+	unsigned long long int rangeLength;	/* Length of extracted part of each file (~0 - to end of file) */
+
+	const char * names;		/* File with exact names of files to extract (one name per line) or - for stdin */
+
+};
 
 /*************
  * Variables *
@@ -88,11 +169,21 @@ extern const char * app;
  *
  * Internaly this function calls SFileCreateArchive or SFileOpenArchive for getting access to archive.
  * For each file check if it has correct name and calls SFileCreateFile. Next it uses SFileWriteFile for writing file data to archive.
+ * Files from manifest and from tar or zip archive are appended after files from array files.
+ *
+ * jobs - more threads open and read files ahead, only current thread writes them (archive is same as with one job)
+ * manifest - one file per line with tab separated local path, name, locale, compression and flags (empty - command line value)
+ * policy - one rule per line with tab separated pattern, compression and flags, first matching rule is used
+ * fromTar, fromZip - entries are read from stream to memory and appended with their names and times
+ * commitFiles, commitBytes - archive tables are written after this number of files or bytes (0 - only at end)
+ * sectorSize, singleUnitThreshold - sector size of new archive, files up to threshold are stored as single unit
+ * UPDATE - skip files with same size and MD5 (or time) as in archive
+ * ENTROPY_CHECK - store files with high entropy of first sectors without compression
  */
-int smpq_append(const char * archive, const char * const files[], unsigned int flags, unsigned int locale, unsigned int maxFileCount, const char * compression);
+int smpq_append(const char * archive, const char * const files[], unsigned int flags, unsigned int locale, unsigned int maxFileCount, const char * compression, const struct smpq_options * options);
 
 /**
- * Extract or print list files from archive
+ * Extract files from archive
  *
  * Internaly this function open archive throw SFileOpenArchive and append all patched archives to memmory by calling SFileOpenPatchArchive
  * For each file mask it calls SFileFindFirstFile. Is return first (and then continue searching) valid file with mask and then it try
@@ -101,11 +192,34 @@ int smpq_append(const char * archive, const char * const files[], unsigned int f
  * windows separator = char backslash '\'). So SFileFindFirstFile only tries check if file witch given name from list is correct
  * for stored hashes. When we use more patched archives it is normal that file with same name is in more patched archives (so search
  * function return one file name more times). To prevent extracting one file more times, smpq remember extracted files. For this is used
- * dictionary struct trie, which spend linear time (of path) for remeber file and linear time too for check if file is in this structre
- * (if file was extracted). When is needed to extract file with long path and subdirs does not exist, smpq will use function mkpath,
- * which recursive create needed directories (find separator '/').
+ * hash set struct nameset with names stored in one arena, which spend linear time (of path) for remember file and linear time too
+ * for check if file was extracted. When is needed to extract file with long path and subdirs does not exist, smpq will use function
+ * mkpath, which recursive create needed directories (find separator '/'), on POSIX systems created directories are cached.
+ * Files matching one mask are extracted in order of their offsets in archive. Stored files are copied directly from archive file
+ * and files up to 16 MiB are written by asynchronous writer (see writer_open). Created files are sparse.
+ *
+ * jobs - files are extracted by worker threads, each has own archive handle with patched archives
+ * names - files with exact names from file are found directly in hash table, missing names are reported at end (-1 is returned)
+ * range - only part of each file is extracted, StormLib decompresses only sectors covering it
+ * tar - files are written to POSIX tar archive (see writeTarHeader) instead of creating files
+ * UPDATE - skip existing files with same size and time as in archive, with CHECKSUM compare MD5 instead of time
+ * TO_STDOUT - data of files are written to stdout, with FRAMED each file is record with name and data length
+ * SECTOR_CRC - stored files are not copied directly, so checksums are verified by StormLib
+ * NO_URING - asynchronous writer uses pool of threads instead of io_uring
+ */
+int smpq_extract(const char * archive, const char * const files[], unsigned int flags, const char * listfile, unsigned int locale, const char * const parchives[], const struct smpq_options * options);
+
+/**
+ * Print list files from archive
+ *
+ * Listing does not open files in archive, all values are taken from SFILE_FIND_DATA returned by SFileFindFirstFile
+ * and SFileFindNextFile and offsets of files from block table, which is read only once. Output is buffered and written
+ * in big blocks. With flag VERBOSE compressed size, ratio, flags, locale and offset of block are printed too. Without sort
+ * files are printed immediately in order of hash table, otherwise they are collected and sorted by key from options.
+ * Besides text columns list can be printed for other programs as NDJSON (one object per line), CSV with header or only
+ * names terminated by NUL char (for xargs -0). These formats have always all fields and time as Unix timestamp.
  */
-int smpq_extract(const char * archive, const char * const files[], unsigned int flags, const char * listfile, unsigned int locale, const char * const parchives[]);
+int smpq_list(const char * archive, const char * const files[], unsigned int flags, const char * listfile, unsigned int locale, const char * const parchives[], const struct smpq_options * options);
 
 /**
  * Show info about archive
@@ -118,8 +232,9 @@ int smpq_info(const char * archive, unsigned int flags);
  * Remove file(s) from archive
  *
  * Internaly this function only calls for each specified file SFileRemoveFile if exist.
+ * Maximum file count is decreased only when hash table is four times bigger than needed (see resizeCapacity).
  */
-int smpq_remove(const char * archive, const char * const files[], unsigned int flags, const char * listfile, unsigned int locale);
+int smpq_remove(const char * archive, const char * const files[], unsigned int flags, const char * listfile, unsigned int locale, const struct smpq_options * options);
 
 /**
  * Rename file in archive
@@ -136,6 +251,50 @@ int smpq_rename(const char * archive, const char * oldName, const char * newName
  */
 void smpq_systemlistfiles(void * SArchive, const char * archive, unsigned int flags);
 
+/* Open archive for reading and patched archives (prefix:archive), return NULL on error */
+void * openArchive(const char * archive, unsigned int flags, unsigned int SFlags, const char * const parchives[]);
+
+/* Block table and hi-block table of archive, read once so offsets of files are known without opening them */
+struct blocktable {
+
+	void * blocks;			/* Array of TMPQBlock, NULL when archive does not have block table */
+	unsigned short * blocksHi;	/* NULL when archive does not have hi-block table */
+	unsigned int count;
+
+};
+
+void readBlockTable(struct blocktable * table, void * SArchive);
+void freeBlockTable(struct blocktable * table);
+
+/* Return offset of block relative to archive header or ~0 when it is not known */
+unsigned long long int blockOffset(const struct blocktable * table, unsigned int blockIndex);
+
+/****************************************
+ * Functions for capacity of hash table *
+ ****************************************/
+
+/* Check if archive has HET table (archives version 3 and 4) */
+int hasHetTable(void * SArchive);
+
+/**
+ * Return maximum file count (power of two) for number of files
+ *
+ * Number of files is increased by headroom and divided by load factor. Archives version 3 and 4 have HET table, which
+ * StormLib creates with 4/3 slots of maximum file count, so for them (het is nonzero) load factor is computed from HET table.
+ */
+unsigned int planCapacity(unsigned int fileCount, int het, const struct smpq_options * options);
+
+/**
+ * Return new maximum file count when current one should be changed or 0
+ *
+ * Every change rebuilds hash table, so table grows only when load factor is crossed and shrinks only when it is four times
+ * bigger than needed. Appending and removing few files near boundary does not change it again and again.
+ */
+unsigned int resizeCapacity(unsigned int fileCount, unsigned int maxFileCount, int het, const struct smpq_options * options);
+
+/* Write load factor and expected probe length of hash table to buffer (at least 256 bytes) */
+void describeCapacity(char * buffer, unsigned int fileCount, unsigned int maxFileCount, int het);
+
 /************************
  * Functions for output *
  ************************/
@@ -149,6 +308,169 @@ void printVerbose(const char * archive, const char * message, const char * file)
 /* Print normal message */
 void printMessage(const char * message, ...);
 
+/* Print verbose and normal messages to stderr, used when stdout has data of extracted files */
+void redirectMessages(void);
+
+/**
+ * Buffered output
+ *
+ * Long listings are written to stdout buffer, which is written only when it is full and by flushBuffered, so output
+ * is not flushed after each line. Messages printed by printMessage and printVerbose are not buffered, so these functions
+ * should not be mixed together.
+ */
+
+void printBuffered(const char * message, ...);
+void writeBuffered(const char * data, size_t size);
+void flushBuffered(void);
+
+/* Print string quoted and escaped for JSON */
+void printJsonString(const char * str);
+
+/* Print string as CSV field */
+void printCsvString(const char * str);
+
+/* Return FILETIME formatted as local time for listing, string is valid only until next call */
+const char * formatFileTime(unsigned long long int SFileTime);
+
+/**************************************
+ * Functions for tar and zip archives *
+ **************************************/
+
+/**
+ * Write header of regular file to tar archive
+ *
+ * Header is in ustar format. Name longer than 100 chars is split to prefix and name at separator '/', when it is not
+ * possible, pax extended header with path is written before. Data of file must be followed by writeTarPadding.
+ */
+int writeTarHeader(FILE * file, const char * name, unsigned long long int size, time_t mtime);
+
+/* Pad data of file with given size to whole tar block */
+int writeTarPadding(FILE * file, unsigned long long int size);
+
+/* Write end of tar archive (two empty blocks) */
+int writeTarEnd(FILE * file);
+
+/* Tar or zip archive read from stream, buffer has bytes which were read from stream but not used yet */
+struct container {
+
+	FILE * file;
+	int zip;
+
+	unsigned char buffer[0x10000];
+	size_t start;
+	size_t end;
+
+};
+
+/* File read from container, errnum is set when file cannot be read, but next file can be */
+struct containerEntry {
+
+	char name[1024];
+	time_t mtime;
+	unsigned long long int size;
+	unsigned char * data;
+	int errnum;
+
+};
+
+/**
+ * Read next regular file from container to memory, return 1 for file, 0 at end of archive and -1 when archive cannot be read
+ *
+ * Stream is read only forward, so it can be pipe. Tar archives can be in ustar, pax or GNU format (long names).
+ * Zip archives are read by local headers, stored entries with data descriptor and without sizes end at first descriptor
+ * with matching size. Deflate method is supported only with zlib. Directories and other special entries are skipped.
+ * Data of file (entry->data) must be freed.
+ */
+int readContainerEntry(struct container * c, struct containerEntry * entry);
+
+/***********************************************
+ * Functions for asynchronous writing of files *
+ ***********************************************/
+
+#if defined(HAVE_PTHREAD) && ! defined(WIN32) && ! defined(_MSC_VER)
+#define HAVE_ASYNC_WRITER
+#endif
+
+/* Writer of extracted files, with liburing files are written by io_uring (unless flag NO_URING), otherwise by pool of threads */
+struct writer;
+
+/* Start writer with number of threads (used only by thread pool), return NULL on error */
+struct writer * writer_open(const char * archive, unsigned int flags, unsigned int threads);
+
+/**
+ * Pass file with data in memory to writer, return -1 on error
+ *
+ * Writer creates file with name relative to directory descriptor (openat, fallocate, write, close) and sets its
+ * modification time (utimensat). Data must be allocated by malloc, writer frees it. When too much data is pending,
+ * function waits until some files are written. Errors are reported by writer with fileName.
+ */
+int writer_submit(struct writer * w, int dirFd, const char * name, const char * fileName, unsigned char * data, size_t size, time_t mtime);
+
+/* Wait until all pending files are written and stop writer */
+void writer_close(struct writer * w);
+
+/**
+ * Write data to file at offset, blocks (4096 bytes aligned in file) with only zeros are skipped, return -1 on error
+ *
+ * File must have final size set before (ftruncate), so skipped blocks are holes and file system does not allocate them.
+ */
+int writeSparse(int fd, const void * data, size_t size, unsigned long long int offset);
+
+/**************************
+ * Functions for MD5 hash *
+ **************************/
+
+/* MD5 is stored in (attributes) file for each file in archive */
+struct md5 {
+
+	unsigned int state[4];
+	unsigned long long int count;
+	unsigned char buffer[64];
+
+};
+
+void md5Init(struct md5 * ctx);
+void md5Update(struct md5 * ctx, const void * data, size_t size);
+void md5Final(struct md5 * ctx, unsigned char digest[16]);
+
+/******************************
+ * Functions for set of names *
+ ******************************/
+
+/* Set of names, names are stored in one growing arena and table slots have offsets to it */
+struct nameset {
+
+	struct nameslot {
+
+		unsigned int hash;
+		size_t name;	/* Offset of name in arena plus one, 0 for empty slot */
+		int value;
+
+	} * slots;
+
+	unsigned int size;
+	unsigned int count;
+
+	char * arena;
+	size_t arenaSize;
+	size_t arenaUsed;
+
+};
+
+/* Initialize empty set for expected number of names, memory is allocated by first add */
+void nameset_init(struct nameset * set, unsigned int expected);
+
+/* Remove all names, memory is kept for next use */
+void nameset_clear(struct nameset * set);
+
+void nameset_free(struct nameset * set);
+
+/* Find name in set, return its slot (valid until next add) or NULL */
+const struct nameslot * nameset_get(const struct nameset * set, const char * str);
+
+/* Add name with value to set, return 0 if it was already in set, 1 if it was added and -1 on error */
+int nameset_add(struct nameset * set, const char * str, int value);
+
 /*************************************
  * Functions for FILETIME conversion *
  *************************************/
@@ -197,6 +519,35 @@ static inline int fromFileTime(time_t * to, unsigned long long int from) {
 #undef OFFSET
 #undef NSEC
 
+/******************************
+ * Functions for measure time *
+ ******************************/
+
+/* Return monotonic time in nanoseconds */
+static inline unsigned long long int getTime(void) {
+
+#if defined(WIN32) || defined(_MSC_VER)
+
+	LARGE_INTEGER counter;
+	LARGE_INTEGER frequency;
+
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+
+	return ( counter.QuadPart / frequency.QuadPart ) * 1000000000ULL + ( counter.QuadPart % frequency.QuadPart ) * 1000000000ULL / frequency.QuadPart;
+
+#else
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+#endif
+
+}
+
 /**********************************************
  * Functions for path conversation in archive *
  **********************************************/
@@ -0,0 +1,790 @@
+/*
+    container.c - StormLib MPQ archiving utility
+    Copyright (C) 2010 - 2016  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* Reading of tar and zip archives from stream (pipe or file) without seeking */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "common.h"
+
+#define TAR_BLOCK 512
+
+/* Maximal size of pax extended header which is read to memory */
+#define PAX_MAX 0x100000
+
+/* Read from buffer of container and then from stream, return number of read bytes */
+static size_t readContainer(struct container * c, void * data, size_t size) {
+
+	size_t done = c->end - c->start;
+
+	if ( done > size )
+		done = size;
+
+	memcpy(data, c->buffer + c->start, done);
+	c->start += done;
+
+	if ( done < size )
+		done += fread((unsigned char *)data + done, 1, size - done, c->file);
+
+	return done;
+
+}
+
+/* Read and throw away bytes of stream, which cannot be seeked */
+static int skipContainer(struct container * c, unsigned long long int size) {
+
+	unsigned char buffer[0x1000];
+
+	while ( size > 0 ) {
+
+		size_t bytes = size > sizeof(buffer) ? sizeof(buffer) : (size_t)size;
+
+		if ( readContainer(c, buffer, bytes) != bytes )
+			return -1;
+
+		size -= bytes;
+
+	}
+
+	return 0;
+
+}
+
+/* Read data of entry with known size to new allocated memory */
+static int readData(struct container * c, struct containerEntry * entry, unsigned long long int size) {
+
+	entry->size = size;
+	entry->data = (unsigned char *)malloc(size ? size : 1);
+
+	if ( ! entry->data ) {
+
+		entry->errnum = ENOMEM;
+		return skipContainer(c, size);
+
+	}
+
+	if ( readContainer(c, entry->data, size) != size ) {
+
+		free(entry->data);
+		entry->data = NULL;
+		errno = EIO;
+		return -1;
+
+	}
+
+	return 0;
+
+}
+
+/* Copy name and remove leading "./" and "/", directories have name with trailing '/' */
+static void setName(struct containerEntry * entry, const char * name, size_t len) {
+
+	while ( len > 0 && ( name[0] == '/' || ( name[0] == '.' && len > 1 && name[1] == '/' ) ) ) {
+
+		if ( name[0] == '.' ) {
+
+			++name;
+			--len;
+
+		}
+
+		++name;
+		--len;
+
+	}
+
+	if ( len + 1 > sizeof(entry->name) ) {
+
+		entry->errnum = ENAMETOOLONG;
+		len = sizeof(entry->name) - 1;
+
+	}
+
+	memcpy(entry->name, name, len);
+	entry->name[len] = 0;
+
+}
+
+/* Parse octal number of tar header, numbers with highest bit set are stored in base-256 */
+static unsigned long long int tarNumber(const char * field, size_t size) {
+
+	unsigned long long int value = 0;
+	size_t i = 0;
+
+	if ( (unsigned char)field[0] & 0x80 ) {
+
+		value = (unsigned char)field[0] & 0x7F;
+
+		for ( i = 1; i < size; ++i )
+			value = ( value << 8 ) | (unsigned char)field[i];
+
+		return value;
+
+	}
+
+	while ( i < size && ( field[i] == ' ' || field[i] == 0 ) )
+		++i;
+
+	for ( ; i < size && field[i] >= '0' && field[i] <= '7'; ++i )
+		value = value * 8 + ( field[i] - '0' );
+
+	return value;
+
+}
+
+/* Parse records of pax extended header, only path, size and mtime are used */
+static void parsePax(char * data, size_t size, struct containerEntry * entry, int * hasName, unsigned long long int * paxSize, int * hasSize) {
+
+	char * end = data + size;
+
+	while ( data < end ) {
+
+		char * record = data;
+		unsigned long int len = strtoul(data, &record, 10);
+		char * key;
+		char * value;
+
+		if ( len == 0 || record == data || *record != ' ' || len > (unsigned long int)( end - data ) )
+			return;
+
+		key = record + 1;
+		value = memchr(key, '=', data + len - key);
+		data[len - 1] = 0;
+
+		if ( value ) {
+
+			*(value++) = 0;
+
+			if ( strcmp(key, "path") == 0 ) {
+
+				setName(entry, value, strlen(value));
+				*hasName = 1;
+
+			} else if ( strcmp(key, "size") == 0 ) {
+
+				*paxSize = strtoull(value, NULL, 10);
+				*hasSize = 1;
+
+			} else if ( strcmp(key, "mtime") == 0 ) {
+
+				entry->mtime = strtol(value, NULL, 10);
+
+			}
+
+		}
+
+		data += len;
+
+	}
+
+}
+
+/* Read next regular file from tar archive, other types of entries are skipped */
+static int readTarEntry(struct container * c, struct containerEntry * entry) {
+
+	int hasName = 0;
+	int hasSize = 0;
+	unsigned long long int paxSize = 0;
+	time_t paxTime = 0;
+
+	entry->mtime = 0;
+
+	while ( 1 ) {
+
+		unsigned char block[TAR_BLOCK];
+		unsigned int checksum = 0;
+		unsigned long long int size;
+		size_t got = readContainer(c, block, TAR_BLOCK);
+		int i;
+
+		if ( got == 0 )
+			return 0;
+
+		if ( got != TAR_BLOCK ) {
+
+			errno = EIO;
+			return -1;
+
+		}
+
+		for ( i = 0; i < TAR_BLOCK; ++i )
+			checksum += ( i >= 148 && i < 156 ) ? ' ' : block[i];
+
+		/* Archive ends with empty blocks */
+		if ( checksum == 8 * ' ' )
+			return 0;
+
+		if ( checksum != tarNumber((char *)block + 148, 8) ) {
+
+			errno = EINVAL;
+			return -1;
+
+		}
+
+		size = tarNumber((char *)block + 124, 12);
+
+		if ( hasSize )
+			size = paxSize;
+
+		if ( ! hasName ) {
+
+			char name[256 + 1];
+			size_t len = 0;
+
+			/* Name of ustar archive can have prefix */
+			if ( memcmp(block + 257, "ustar", 5) == 0 && block[345] ) {
+
+				len = strnlen((char *)block + 345, 155);
+				memcpy(name, block + 345, len);
+				name[len++] = '/';
+
+			}
+
+			i = strnlen((char *)block, 100);
+			memcpy(name + len, block, i);
+			len += i;
+
+			setName(entry, name, len);
+
+		}
+
+		if ( ! paxTime )
+			entry->mtime = tarNumber((char *)block + 136, 12);
+
+		if ( block[156] == 'x' || block[156] == 'L' ) {
+
+			char * data;
+
+			if ( size > PAX_MAX ) {
+
+				errno = EINVAL;
+				return -1;
+
+			}
+
+			data = (char *)malloc(size + 1);
+
+			if ( ! data )
+				return -1;
+
+			if ( readContainer(c, data, size) != size || skipContainer(c, ( TAR_BLOCK - size % TAR_BLOCK ) % TAR_BLOCK) == -1 ) {
+
+				free(data);
+				errno = EIO;
+				return -1;
+
+			}
+
+			data[size] = 0;
+
+			/* Extended header (pax) or long name (GNU) is used for next entry */
+			if ( block[156] == 'x' ) {
+
+				entry->mtime = 0;
+				parsePax(data, size, entry, &hasName, &paxSize, &hasSize);
+				paxTime = entry->mtime;
+
+			} else {
+
+				setName(entry, data, strlen(data));
+				hasName = 1;
+
+			}
+
+			free(data);
+			continue;
+
+		}
+
+		/* Only regular files are stored, directories are created from names */
+		if ( ( block[156] != '0' && block[156] != 0 && block[156] != '7' ) || entry->name[0] == 0 || entry->name[strlen(entry->name) - 1] == '/' ) {
+
+			if ( skipContainer(c, size + ( TAR_BLOCK - size % TAR_BLOCK ) % TAR_BLOCK) == -1 ) {
+
+				errno = EIO;
+				return -1;
+
+			}
+
+			hasName = 0;
+			hasSize = 0;
+			paxTime = 0;
+			entry->errnum = 0;
+			continue;
+
+		}
+
+		/* Size of file in MPQ archive is 32 bit */
+		if ( size > 0xFFFFFFFF ) {
+
+			entry->errnum = EFBIG;
+
+			if ( skipContainer(c, size) == -1 ) {
+
+				errno = EIO;
+				return -1;
+
+			}
+
+		} else if ( readData(c, entry, size) == -1 ) {
+
+			return -1;
+
+		}
+
+		if ( skipContainer(c, ( TAR_BLOCK - size % TAR_BLOCK ) % TAR_BLOCK) == -1 ) {
+
+			errno = EIO;
+			return -1;
+
+		}
+
+		return 1;
+
+	}
+
+}
+
+/* Little endian numbers of zip headers */
+static unsigned int zip16(const unsigned char * data) {
+
+	return data[0] | ( data[1] << 8 );
+
+}
+
+static unsigned int zip32(const unsigned char * data) {
+
+	return zip16(data) | ( (unsigned int)zip16(data + 2) << 16 );
+
+}
+
+static unsigned long long int zip64(const unsigned char * data) {
+
+	return zip32(data) | ( (unsigned long long int)zip32(data + 4) << 32 );
+
+}
+
+/* Read field of zip header, too long field is truncated and rest is skipped, return number of stored bytes or -1 */
+static unsigned int readField(struct container * c, void * buffer, size_t size, unsigned int len) {
+
+	size_t bytes = len < size ? len : size;
+
+	if ( readContainer(c, buffer, bytes) != bytes || skipContainer(c, len - bytes) == -1 )
+		return (unsigned int)-1;
+
+	return bytes;
+
+}
+
+/* Convert MS-DOS date and time (local time) to time_t */
+static time_t dosTime(unsigned int date, unsigned int time) {
+
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = ( date >> 9 ) + 80;
+	tm.tm_mon = ( ( date >> 5 ) & 15 ) - 1;
+	tm.tm_mday = date & 31;
+	tm.tm_hour = time >> 11;
+	tm.tm_min = ( time >> 5 ) & 63;
+	tm.tm_sec = ( time & 31 ) * 2;
+	tm.tm_isdst = -1;
+
+	return mktime(&tm);
+
+}
+
+#ifdef HAVE_ZLIB
+
+/* Inflate deflate stream, which ends itself, so compressed size does not have to be known (entries with data descriptor) */
+static int inflateData(struct container * c, struct containerEntry * entry, unsigned long long int compressedSize, unsigned long long int size, int knownSize) {
+
+	z_stream z;
+	size_t allocated = knownSize ? ( size ? size : 1 ) : 0x10000;
+	int ret = Z_OK;
+
+	memset(&z, 0, sizeof(z));
+
+	if ( inflateInit2(&z, -MAX_WBITS) != Z_OK ) {
+
+		errno = ENOMEM;
+		return -1;
+
+	}
+
+	entry->data = (unsigned char *)malloc(allocated);
+	entry->size = 0;
+
+	if ( ! entry->data ) {
+
+		inflateEnd(&z);
+		errno = ENOMEM;
+		return -1;
+
+	}
+
+	while ( ret != Z_STREAM_END ) {
+
+		size_t avail;
+
+		if ( c->start == c->end ) {
+
+			c->start = 0;
+			c->end = fread(c->buffer, 1, sizeof(c->buffer), c->file);
+
+			if ( c->end == 0 )
+				break;
+
+		}
+
+		avail = c->end - c->start;
+
+		if ( knownSize && avail > compressedSize )
+			avail = compressedSize;
+
+		if ( knownSize && compressedSize == 0 )
+			break;
+
+		/* Size of file in MPQ archive is 32 bit */
+		if ( entry->size == allocated ) {
+
+			unsigned char * data = NULL;
+
+			if ( allocated * 2 <= 0xFFFFFFFFULL )
+				data = (unsigned char *)realloc(entry->data, allocated * 2);
+
+			if ( ! data )
+				break;
+
+			entry->data = data;
+			allocated *= 2;
+
+		}
+
+		z.next_in = c->buffer + c->start;
+		z.avail_in = avail;
+		z.next_out = entry->data + entry->size;
+		z.avail_out = allocated - entry->size;
+
+		ret = inflate(&z, Z_NO_FLUSH);
+
+		c->start += avail - z.avail_in;
+		compressedSize -= avail - z.avail_in;
+		entry->size = allocated - z.avail_out;
+
+		if ( ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR )
+			break;
+
+		if ( ret == Z_BUF_ERROR && knownSize && entry->size == size )
+			break;
+
+	}
+
+	inflateEnd(&z);
+
+	if ( ret != Z_STREAM_END || ( knownSize && entry->size != size ) ) {
+
+		free(entry->data);
+		entry->data = NULL;
+		errno = EINVAL;
+		return -1;
+
+	}
+
+	return 0;
+
+}
+
+#endif
+
+/**
+ * Read stored data of zip entry without sizes in local header, return -1 on error
+ *
+ * Data end at data descriptor with signature and sizes equal to number of bytes before it, descriptor is read too.
+ */
+static int readStoredData(struct container * c, struct containerEntry * entry, int zip64Sizes, unsigned int * crc) {
+
+	size_t len = zip64Sizes ? 24 : 16;
+	size_t allocated = 0x10000;
+	size_t used = 0;
+	unsigned char * data = (unsigned char *)malloc(allocated);
+
+	if ( ! data ) {
+
+		errno = ENOMEM;
+		return -1;
+
+	}
+
+	while ( 1 ) {
+
+		if ( used == allocated ) {
+
+			unsigned char * grown = (unsigned char *)realloc(data, allocated * 2);
+
+			if ( ! grown ) {
+
+				free(data);
+				errno = ENOMEM;
+				return -1;
+
+			}
+
+			data = grown;
+			allocated *= 2;
+
+		}
+
+		if ( readContainer(c, data + used, 1) != 1 ) {
+
+			free(data);
+			errno = EIO;
+			return -1;
+
+		}
+
+		++used;
+
+		if ( used >= len ) {
+
+			const unsigned char * descriptor = data + used - len;
+			unsigned long long int size = used - len;
+
+			if ( zip32(descriptor) == 0x08074b50 && ( zip64Sizes ? ( zip64(descriptor + 8) == size && zip64(descriptor + 16) == size ) : ( zip32(descriptor + 8) == size && zip32(descriptor + 12) == size ) ) ) {
+
+				*crc = zip32(descriptor + 4);
+				entry->data = data;
+				entry->size = size;
+				return 0;
+
+			}
+
+		}
+
+	}
+
+}
+
+/* Read next file from zip archive, entries are read by local headers, so central directory at end is not needed */
+static int readZipEntry(struct container * c, struct containerEntry * entry) {
+
+	while ( 1 ) {
+
+		unsigned char header[30];
+		unsigned char extra[1024];
+		char name[1024];
+		unsigned int flags, method, nameLen, extraLen, i;
+		unsigned int crc;
+		unsigned long long int compressedSize, size;
+		int zip64Sizes = 0;
+		size_t got = readContainer(c, header, 4);
+
+		if ( got == 0 )
+			return 0;
+
+		if ( got != 4 ) {
+
+			errno = EIO;
+			return -1;
+
+		}
+
+		/* Local headers are followed by central directory */
+		if ( zip32(header) == 0x02014b50 || zip32(header) == 0x06054b50 || zip32(header) == 0x06064b50 )
+			return 0;
+
+		if ( zip32(header) != 0x04034b50 || readContainer(c, header + 4, 26) != 26 ) {
+
+			errno = EINVAL;
+			return -1;
+
+		}
+
+		flags = zip16(header + 6);
+		method = zip16(header + 8);
+		crc = zip32(header + 14);
+		compressedSize = zip32(header + 18);
+		size = zip32(header + 22);
+		nameLen = zip16(header + 26);
+		extraLen = zip16(header + 28);
+
+		nameLen = readField(c, name, sizeof(name), nameLen);
+		extraLen = readField(c, extra, sizeof(extra), extraLen);
+
+		if ( nameLen == (unsigned int)-1 || extraLen == (unsigned int)-1 ) {
+
+			errno = EIO;
+			return -1;
+
+		}
+
+		setName(entry, name, nameLen);
+		entry->mtime = dosTime(zip16(header + 12), zip16(header + 10));
+
+		for ( i = 0; i + 4 <= extraLen; i += 4 + zip16(extra + i + 2) ) {
+
+			unsigned int id = zip16(extra + i);
+			unsigned int len = zip16(extra + i + 2);
+
+			if ( i + 4 + len > extraLen )
+				break;
+
+			/* Zip64 extended information has sizes which do not fit to 32 bits of header */
+			if ( id == 0x0001 && len >= 16 ) {
+
+				size = zip64(extra + i + 4);
+				compressedSize = zip64(extra + i + 12);
+				zip64Sizes = 1;
+
+			}
+
+			/* Extended timestamp has modification time as Unix time */
+			if ( id == 0x5455 && len >= 5 && ( extra[i + 4] & 1 ) )
+				entry->mtime = (int)zip32(extra + i + 5);
+
+		}
+
+		if ( flags & 1 ) {
+
+			entry->errnum = EPERM;
+
+			if ( ( flags & 8 ) || skipContainer(c, compressedSize) == -1 ) {
+
+				errno = EINVAL;
+				return -1;
+
+			}
+
+			return 1;
+
+		}
+
+		if ( method == 0 ) {
+
+			/* With data descriptor sizes can be stored only after data */
+			if ( ( flags & 8 ) && compressedSize == 0 ) {
+
+				if ( readStoredData(c, entry, zip64Sizes, &crc) == -1 )
+					return -1;
+
+				flags &= ~8;
+
+			} else if ( size > 0xFFFFFFFF ) {
+
+				entry->errnum = EFBIG;
+
+				if ( skipContainer(c, size) == -1 ) {
+
+					errno = EIO;
+					return -1;
+
+				}
+
+			} else if ( readData(c, entry, size) == -1 ) {
+
+				return -1;
+
+			}
+
+#ifdef HAVE_ZLIB
+		} else if ( method == 8 ) {
+
+			if ( inflateData(c, entry, compressedSize, size, ! ( flags & 8 )) == -1 )
+				return -1;
+#endif
+
+		} else {
+
+			entry->errnum = ENOSYS;
+
+			if ( ( flags & 8 ) || skipContainer(c, compressedSize) == -1 ) {
+
+				errno = EINVAL;
+				return -1;
+
+			}
+
+		}
+
+		if ( flags & 8 ) {
+
+			unsigned char descriptor[24];
+			unsigned int len = zip64Sizes ? 16 : 8;
+
+			/* Signature of data descriptor is optional */
+			if ( readContainer(c, descriptor, 4) != 4 || ( zip32(descriptor) == 0x08074b50 && readContainer(c, descriptor, 4) != 4 ) || readContainer(c, descriptor + 4, len) != len ) {
+
+				errno = EIO;
+				return -1;
+
+			}
+
+			crc = zip32(descriptor);
+
+		}
+
+#ifdef HAVE_ZLIB
+		if ( entry->data && crc32(crc32(0, NULL, 0), entry->data, entry->size) != crc ) {
+
+			free(entry->data);
+			entry->data = NULL;
+			entry->errnum = EIO;
+
+		}
+#else
+		(void)crc;
+#endif
+
+		/* Directories are created from names */
+		if ( entry->name[0] == 0 || entry->name[strlen(entry->name) - 1] == '/' ) {
+
+			free(entry->data);
+			entry->data = NULL;
+			entry->errnum = 0;
+			continue;
+
+		}
+
+		return 1;
+
+	}
+
+}
+
+int readContainerEntry(struct container * c, struct containerEntry * entry) {
+
+	entry->name[0] = 0;
+	entry->size = 0;
+	entry->data = NULL;
+	entry->errnum = 0;
+
+	if ( c->zip )
+		return readZipEntry(c, entry);
+	else
+		return readTarEntry(c, entry);
+
+}
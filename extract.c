@@ -17,6 +17,10 @@
 
 */
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <StormLib.h>
 
 #include <sys/types.h>
@@ -27,10 +31,15 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 #if defined(WIN32) || defined(_MSC_VER)
 
 #include <sys/utime.h>
 #include <direct.h>
+#include <fcntl.h>
 #include <io.h>
 
 #define mkdir _mkdir
@@ -52,8 +61,55 @@ char * dirname(char *);
 
 #endif
 
+#if ! defined(WIN32) && ! defined(_MSC_VER)
+
+#include <fcntl.h>
+#include <unistd.h>
+#define HAVE_OPENAT
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#if defined(__GLIBC__) && ( __GLIBC__ > 2 || ( __GLIBC__ == 2 && __GLIBC_MINOR__ >= 27 ) )
+#define HAVE_COPY_FILE_RANGE
+#endif
+
+#ifndef O_DIRECTORY
+#define O_DIRECTORY 0
+#endif
+
+#else
+
+/* Without openat all files are used by path relative to current directory */
+#define AT_FDCWD -100
+#define fstatat(dirFd, name, st, flag) stat(name, st)
+#define unlinkat(dirFd, name, flag) unlink(name)
+
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 #include "common.h"
 
+/* Maximal number of directory descriptors kept open by directory cache */
+#define DIRCACHE_FDS 256
+
+/* Files up to this size are read to memory and written by asynchronous writer, bigger files are written directly */
+#define ASYNC_WRITE_MAX 0x1000000
+
+/* Size of archive range ahead of extracted file which kernel is asked to read (posix_fadvise) */
+#define READAHEAD_WINDOW 0x800000
+
+#if defined(HAVE_OPENAT) && defined(POSIX_FADV_WILLNEED)
+#define HAVE_FADVISE
+#endif
+
+#ifndef HAVE_OPENAT
+
 static int mkpath(const char * s) {
 
 	char * q = NULL;
@@ -103,380 +159,1735 @@ out:
 
 }
 
-struct trie {
+#endif
 
-	struct trie * t[255];
-	int end;
+/* Open archive and patched archives (prefix:archive), return NULL on error */
+HANDLE openArchive(const char * archive, unsigned int flags, unsigned int SFlags, const char * const parchives[]) {
 
-};
+	int i;
+	HANDLE SArchive = NULL;
+
+	if ( ! SFileOpenArchive(archive, 0, SFlags, &SArchive) ) {
+
+		if ( ! ( flags & QUIET ) )
+			printError(archive, "Cannot open archive", archive, GetLastError());
 
-static const struct trie * trie_alloc(void) {
+		return NULL;
 
-	struct trie * t = (struct trie *)calloc(1, sizeof(struct trie));
-	return t;
+	}
 
-}
+	for ( i = 0; parchives[i]; ++i ) {
 
-static void trie_free(const struct trie * t) {
+		const char * parchive = strchr(parchives[i], ':');
+		char prefix[1024];
 
-	unsigned int i;
+		/* Patched archives are opened for each worker thread, so arguments are not modified */
+		if ( parchive && (size_t)( parchive - parchives[i] ) < sizeof(prefix) ) {
 
-	if ( ! t )
-		return;
+			memcpy(prefix, parchives[i], parchive - parchives[i]);
+			prefix[parchive - parchives[i]] = 0;
+			++parchive;
+
+		} else {
+
+			parchive = parchives[i];
+			prefix[0] = 0;
+
+		}
+
+		if ( flags & VERBOSE )
+			printVerbose(archive, "Opening patched archive", parchive);
 
-	for ( i = 0; i < 255; ++i )
-		if ( t->t[i] )
-			trie_free(t->t[i]);
+		if ( ! SFileOpenPatchArchive(SArchive, parchive, prefix, 0) ) {
+
+			if ( ! ( flags & QUIET ) )
+				printError(archive, "Cannot open patched archive", parchive, GetLastError());
+
+			SFileCloseArchive(SArchive);
+
+			return NULL;
+
+		}
+
+	}
 
-	free((struct trie *)t);
+	return SArchive;
 
 }
 
-static void trie_add(const struct trie * tr, const char * str) {
+/* Settings of extraction, shared by all threads */
+struct extraction {
 
-	unsigned int i;
-	unsigned int len = strlen(str);
+	const char * archive;
+	unsigned int flags;
+
+	/* Statistics of flag UPDATE */
+	unsigned int skippedFiles;
+	unsigned long long int skippedBytes;
+	unsigned int rewrittenFiles;
+
+	/* Names file cannot be read or some listed names are not in archive, extraction returns error */
+	int namesFailed;
+
+	/* Statistics of read order for flag VERBOSE, backward seeks in order in which files were found and in order of reading */
+	unsigned int foundSeeks;
+	unsigned long long int foundSeekBytes;
+	unsigned int readSeeks;
+	unsigned long long int readSeekBytes;
+
+	/* Range of each file which is extracted (rangeLength ~0 - to end of file) */
+	unsigned long long int rangeOffset;
+	unsigned long long int rangeLength;
+	unsigned int sectorSize;
 
-	struct trie * t = (struct trie *)tr;
+	/* Stream for data of files (stdout or tar archive), NULL when files are created */
+	FILE * stream;
+	const char * streamName;
+	int tar;
 
-	for ( i = 0; i < len; ++i ) {
+#ifdef HAVE_OPENAT
+	/* Cache of created directories, value is open descriptor of directory or -1 */
+	struct nameset dirs;
+	unsigned int dirFds;
 
-		if ( ! t->t[(int)str[i]] )
-			t->t[(int)str[i]] = (struct trie *)trie_alloc();
+	/* Second descriptor of archive for read-ahead hints and copying of stored files, -1 when it is not used */
+	int archiveFd;
+	unsigned long long int headerOffset;
+#endif
+
+#ifdef HAVE_PTHREAD
+	/* Lock for directory cache (or for mkpath, dirname is not thread safe on all systems) */
+	pthread_mutex_t mutex;
+#endif
+
+#ifdef HAVE_ASYNC_WRITER
+	/* Writer of created files, NULL when files are written directly */
+	struct writer * writer;
+#endif
+
+#ifdef HAVE_PTHREAD
+	/* Queue of worker threads, NULL when files are extracted by current thread */
+	struct queue * queue;
+#endif
+
+};
+
+/* File found in archive, name is offset to names arena of found files */
+struct found {
+
+	size_t name;
+	unsigned int compressedSize;
+	unsigned long long int offset;	/* Offset of block in archive or ~0 when it is not known (only order of reading) */
+	unsigned long long int SFileTime;
+
+};
+
+/* Files found for one argument, they are extracted in order of their offsets in archive */
+struct foundFiles {
+
+	struct found * files;
+	unsigned int count;
+	unsigned int size;
+
+	char * names;
+	size_t namesSize;
+	size_t namesUsed;
+
+};
+
+
+#ifdef HAVE_OPENAT
+
+/**
+ * Return descriptor of directory (created when it is missing), AT_FDCWD when directory is not kept open or -1 on error
+ *
+ * Created directories are remembered, so directory used again does not need any syscall. Missing directories are created
+ * by mkdirat relative to descriptor of their parent. First DIRCACHE_FDS directories are kept open, others are used by path.
+ */
+static int openDirectory(struct extraction * x, const char * path) {
+
+	const struct nameslot * slot = nameset_get(&x->dirs, path);
+	const char * name = strrchr(path, '/');
+	const char * relative = path;
+	int parentFd = AT_FDCWD;
+	int fd = -1;
+
+	if ( slot )
+		return slot->value != -1 ? slot->value : AT_FDCWD;
+
+	if ( name && name != path ) {
+
+		char parent[1024];
+
+		memcpy(parent, path, name - path);
+		parent[name - path] = 0;
+
+		parentFd = openDirectory(x, parent);
+
+		if ( parentFd == -1 )
+			return -1;
+
+		if ( parentFd != AT_FDCWD )
+			relative = name + 1;
+
+	}
 
-		t = t->t[(int)str[i]];
+	if ( mkdirat(parentFd, relative, S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH) == -1 && errno != EEXIST )
+		return -1;
+
+	if ( x->dirFds < DIRCACHE_FDS ) {
+
+		fd = openat(parentFd, relative, O_RDONLY | O_DIRECTORY);
+
+		if ( fd != -1 )
+			++x->dirFds;
+
+	}
+
+	if ( nameset_add(&x->dirs, path, fd) == -1 && fd != -1 ) {
+
+		close(fd);
+		--x->dirFds;
+		fd = -1;
 
 	}
 
-	t->end = 1;
+	return fd != -1 ? fd : AT_FDCWD;
 
 }
 
-static int trie_find(const struct trie * tr, const char * str) {
+/* Close directories in cache */
+static void closeDirectories(struct extraction * x) {
 
 	unsigned int i;
-	unsigned int len = strlen(str);
 
-	struct trie * t = (struct trie *)tr;
+	if ( x->dirs.slots )
+		for ( i = 0; i < x->dirs.size; ++i )
+			if ( x->dirs.slots[i].name && x->dirs.slots[i].value != -1 )
+				close(x->dirs.slots[i].value);
+
+	nameset_free(&x->dirs);
+
+}
+
+#endif
+
+/* Compute MD5 of file on disk, return -1 when it cannot be read */
+static int hashFile(int dirFd, const char * name, unsigned char md5[16]) {
+
+	struct md5 ctx;
+	unsigned char buffer[0x10000];
+	int fd;
+	int bytes;
+
+#ifdef HAVE_OPENAT
+	fd = openat(dirFd, name, O_RDONLY | O_BINARY);
+#else
+	fd = open(name, O_RDONLY | O_BINARY);
+#endif
+
+	if ( fd == -1 )
+		return -1;
+
+	md5Init(&ctx);
+
+	while ( ( bytes = read(fd, buffer, sizeof(buffer)) ) > 0 )
+		md5Update(&ctx, buffer, bytes);
+
+	close(fd);
+
+	if ( bytes < 0 )
+		return -1;
+
+	md5Final(&ctx, md5);
+
+	return 0;
+
+}
+
+/**
+ * Check if existing file is same as file in archive, return nonzero when it does not have to be extracted
+ *
+ * Size must be same. With flag CHECKSUM MD5 of file is compared with MD5 from (attributes), otherwise (or when archive
+ * does not have MD5) modification time is compared, extracted files have time of file in archive.
+ */
+static int unchangedFile(struct extraction * x, HANDLE SFile, int dirFd, const char * name, const struct stat * st, unsigned long long int fileSize, time_t fileTime) {
+
+	static const unsigned char noMd5[16] = { 0 };
 
-	for ( i = 0; i < len; ++i ) {
+	TFileEntry entry;
+	unsigned char md5[16];
 
-		t = t->t[(int)str[i]];
+	if ( (unsigned long long int)st->st_size != fileSize )
+		return 0;
+
+	if ( ( x->flags & CHECKSUM ) && SFileGetFileInfo(SFile, SFileInfoFileEntry, &entry, sizeof(entry), NULL) && memcmp(entry.md5, noMd5, sizeof(noMd5)) != 0 ) {
 
-		if ( ! t )
+		if ( hashFile(dirFd, name, md5) == -1 )
 			return 0;
 
+		return memcmp(entry.md5, md5, sizeof(md5)) == 0;
+
 	}
 
-	return t->end;
+	return fileTime != 0 && st->st_mtime == fileTime;
 
 }
 
-int smpq_extract(const char * archive, const char * const files[], unsigned int flags, const char * listfile, unsigned int locale, const char * const parchives[]) {
+/* Write data of opened file in archive to stream, at most maxSize bytes, return number of written bytes */
+static unsigned long long int writeData(struct extraction * x, HANDLE SFile, const char * SFileName, const char * fileName, FILE * file, unsigned long long int maxSize) {
 
-	int i, j;
-	HANDLE SArchive = NULL;
+	unsigned long long int written = 0;
+	char buffer[0x10000];
+	size_t bytes = 1;
 
-	unsigned int SFlags = STREAM_FLAG_READ_ONLY;
+	while ( written < maxSize ) {
 
-	if ( flags & NO_LISTFILE )
-		SFlags |= MPQ_OPEN_NO_LISTFILE;
+		int eof = 0;
 
-	if ( flags & NO_ATTRIBUTES )
-		SFlags |= MPQ_OPEN_NO_ATTRIBUTES;
+		if ( ! SFileReadFile(SFile, buffer, sizeof(buffer), (DWORD *)&bytes, NULL) ) {
 
-	if ( flags & MPQ_VERSION_1 )
-		SFlags |= MPQ_OPEN_FORCE_MPQ_V1;
+			eof = ( GetLastError() == ERROR_HANDLE_EOF );
 
-	if ( flags & SECTOR_CRC )
-		SFlags |= MPQ_OPEN_CHECK_SECTOR_CRC;
+			if ( ! eof ) {
 
-	if ( flags & MPQ_PARTIAL )
-		SFlags |= STREAM_PROVIDER_PARTIAL;
+				if ( ! ( x->flags & QUIET ) )
+					printError(x->archive, "Cannot read file", SFileName, GetLastError());
 
-	if ( flags & MPQ_ENCRYPTED )
-		SFlags |= STREAM_PROVIDER_MPQE;
+				break;
 
-	if ( ! SFileOpenArchive(archive, 0, SFlags, &SArchive) ) {
+			}
 
-		if ( ! ( flags & QUIET ) )
-			printError(archive, "Cannot open archive", archive, GetLastError());
+		}
 
-		return -1;
+		if ( bytes > maxSize - written )
+			bytes = maxSize - written;
+
+		if ( fwrite(buffer, 1, bytes, file) != bytes ) {
+
+			if ( ! ( x->flags & QUIET ) )
+				printError(x->archive, "Cannot write file", fileName, errno);
+
+			break;
+
+		}
+
+		written += bytes;
+
+		if ( eof )
+			break;
 
 	}
 
-	for ( i = 0; parchives[i]; ++i ) {
+	return written;
 
-		char * parchive;
-		const char * prefix;
+}
 
-		if ( ( parchive = strchr((char *)parchives[i], ':') ) ) {
+#ifdef HAVE_ASYNC_WRITER
 
-			*parchive = 0;
-			++parchive;
-			prefix = parchives[i];
+/* Read whole opened file in archive to memory and pass it to writer, return -1 when writer cannot accept it */
+static int submitFile(struct extraction * x, HANDLE SFile, const char * SFileName, int dirFd, const char * name, const char * fileName, unsigned int size, time_t fileTime) {
 
-		} else {
+	unsigned char * data = (unsigned char *)malloc(size ? size : 1);
+	unsigned int total = 0;
 
-			parchive = (char *)parchives[i];
-			prefix = "";
+	if ( ! data )
+		return -1;
 
-		}
+	while ( total < size ) {
 
-		if ( flags & VERBOSE )
-			printVerbose(archive, "Opening patched archive", parchive);
+		DWORD bytes = 0;
 
-		if ( ! SFileOpenPatchArchive(SArchive, parchive, prefix, 0) ) {
+		if ( ! SFileReadFile(SFile, data + total, size - total, &bytes, NULL) ) {
 
-			if ( ! ( flags & QUIET ) )
-				printError(archive, "Cannot open patched archive", parchive, GetLastError());
+			total += bytes;
 
-			SFileCloseArchive(SArchive);
+			if ( GetLastError() != ERROR_HANDLE_EOF && ! ( x->flags & QUIET ) )
+				printError(x->archive, "Cannot read file", SFileName, GetLastError());
 
-			return -1;
+			break;
 
 		}
 
+		if ( bytes == 0 )
+			break;
+
+		total += bytes;
+
 	}
 
-	if ( ! ( flags & NO_SYSTEM_LF ) )
-		smpq_systemlistfiles(SArchive, archive, flags);
+	if ( writer_submit(x->writer, dirFd, name, fileName, data, total, fileTime) == -1 ) {
 
-	if ( ! ( flags & NO_LISTFILE ) )
-		SFileAddListFile(SArchive, NULL);
+		free(data);
+		return -1;
 
-	SFileSetLocale(locale);
+	}
 
-	SFlags = SFILE_OPEN_FROM_MPQ;
+	return 0;
 
-	for ( i = 0; files[i]; ++i ) {
+}
 
-		const struct trie * t;
-		char mask[512];
+#endif
 
-		SFILE_FIND_DATA SFileFindData;
-		HANDLE SFileFind = NULL;
+#ifdef HAVE_OPENAT
 
-		toArchivePath(mask, files[i]);
+/* Write data of opened file in archive to created file, final size is set first and blocks with only zeros stay as holes */
+static int writeSparseData(struct extraction * x, HANDLE SFile, const char * SFileName, const char * fileName, int fd, unsigned long long int size) {
 
-		SFileFind = SFileFindFirstFile(SArchive, mask, &SFileFindData, listfile);
+	unsigned long long int written = 0;
+	unsigned char buffer[0x10000];
+	int ret = 0;
 
-		if ( ! SFileFind ) {
+	if ( size != 0 && ftruncate(fd, size) != 0 ) {
 
-			HANDLE SFile;
+		if ( ! ( x->flags & QUIET ) )
+			printError(x->archive, "Cannot write file", fileName, errno);
 
-			SFileFind = (HANDLE)0xFFFFFFFF;
-			SFileFindData.dwFileTimeLo = 0;
-			SFileFindData.dwFileTimeHi = 0;
+		return -1;
 
-			strcpy(SFileFindData.cFileName, mask);
+	}
 
-			if ( SFileOpenFileEx(SArchive, mask, SFlags, &SFile) ) {
+	while ( written < size ) {
 
-				unsigned int high = 0;
-				unsigned int low = SFileGetFileSize(SFile, (DWORD*)&high);
+		DWORD length = size - written < sizeof(buffer) ? size - written : sizeof(buffer);
+		DWORD bytes = 0;
+		int eof = 0;
 
-				SFileGetFileName(SFile, mask);
+		if ( ! SFileReadFile(SFile, buffer, length, &bytes, NULL) ) {
 
-				SFileFindData.dwFileSize = low | ( (unsigned long long int)high << 32 );
+			eof = ( GetLastError() == ERROR_HANDLE_EOF );
 
-				SFileCloseFile(SFile);
+			if ( ! eof ) {
+
+				if ( ! ( x->flags & QUIET ) )
+					printError(x->archive, "Cannot read file", SFileName, GetLastError());
+
+				ret = -1;
+				break;
 
 			}
 
 		}
 
-		t = trie_alloc();
-
-		while ( SFileFind ) {
+		if ( writeSparse(fd, buffer, bytes, written) != 0 ) {
 
-			struct stat st;
-			FILE * file = NULL;
-			char fileName[1024];
-			char fileDir[1024];
-			unsigned int fileSize = SFileFindData.dwFileSize;
-			time_t fileTime = 0;
+			if ( ! ( x->flags & QUIET ) )
+				printError(x->archive, "Cannot write file", fileName, errno);
 
-			HANDLE SFile = NULL;
-			const char * SFileName = SFileFindData.cFileName;
-			unsigned long long int SFileTime = SFileFindData.dwFileTimeLo | ( ((unsigned long long int)SFileFindData.dwFileTimeHi) << 32 );
+			ret = -1;
+			break;
 
-			int last = 0;
-			char buffer[0x10000];
-			size_t bytes = 1;
+		}
 
-			if ( strlen(SFileFindData.cFileName)+1 > 1024 )
-				goto next;
+		written += bytes;
 
-			if ( strcmp(SFileName, "(listfile)") == 0 || strcmp(SFileName, "(signature)") == 0 || strcmp(SFileName, "(attributes)") == 0 || strstr(SFileName, "(patch_metadata)") != NULL )
-				goto next;
+		if ( eof || bytes == 0 )
+			break;
 
-			fromArchivePath(fileName, SFileName);
+	}
 
-			if ( trie_find(t, SFileName) )
-				goto next;
-			else
-				trie_add(t, SFileName);
+	/* File has only data which were read, same as without holes */
+	if ( written != size && ftruncate(fd, written) != 0 )
+		ret = -1;
 
-			if ( ! fromFileTime(&fileTime, SFileTime) )
-				fileTime = 0;
+	return ret;
 
-			if ( ! SFileOpenFileEx(SArchive, SFileName, SFlags, &SFile) ) {
+}
 
-				if ( ! ( flags & QUIET ) )
-					printError(archive, "Cannot open file in archive", SFileName, GetLastError());
+#endif
 
-				goto next;
+/* Store number as little endian */
+static void littleEndian(unsigned char * buffer, unsigned long long int value, int bytes) {
 
-			}
+	int i;
 
-			j = -1;
+	for ( i = 0; i < bytes; ++i )
+		buffer[i] = ( value >> ( i * 8 ) ) & 0xFF;
 
-			while ( SFileName[++j] )
-				if ( SFileName[j] == '\\' )
-					last = j;
+}
 
-			if ( ( flags & VERBOSE ) && ! ( flags & LIST ) )
-				printVerbose(archive, "Extract", fileName);
+/**
+ * Move file pointer to start of range from options, return number of bytes in range (size of file without range)
+ *
+ * StormLib decompresses sectors from file pointer, so with sector offset table only sectors covering range are read.
+ * File stored as single unit is one block, which is always decompressed whole.
+ */
+static unsigned long long int seekRange(struct extraction * x, HANDLE SFile, const char * SFileName, const char * fileName) {
 
-			if ( ( flags & LIST ) ) {
+	unsigned int high = 0;
+	unsigned int low = SFileGetFileSize(SFile, (DWORD *)&high);
+	unsigned long long int size = low | ( (unsigned long long int)high << 32 );
+	unsigned long long int length;
 
-				char strtime[80];
-				strftime(strtime, 80, "%Y-%m-%d %H:%M", localtime(&fileTime));
-				printMessage("%12u %s %s", fileSize, strtime, fileName);
+	if ( low == SFILE_INVALID_SIZE )
+		size = 0;
 
-			}
+	if ( x->rangeOffset == 0 && x->rangeLength == ~0ULL )
+		return size;
 
-			if ( flags & LIST )
-				goto next;
+	if ( x->rangeOffset >= size )
+		length = 0;
+	else if ( size - x->rangeOffset < x->rangeLength )
+		length = size - x->rangeOffset;
+	else
+		length = x->rangeLength;
 
-			memcpy(fileDir, fileName, last);
-			fileDir[last] = 0;
+	if ( length != 0 ) {
 
-			if ( last != 0 ) {
+		LONG offsetHigh = (LONG)( x->rangeOffset >> 32 );
 
-				if ( mkpath(fileDir) != 0 ) {
+		if ( SFileSetFilePointer(SFile, (LONG)( x->rangeOffset & 0xFFFFFFFF ), &offsetHigh, FILE_BEGIN) == SFILE_INVALID_SIZE ) {
 
-					if ( ! ( flags & QUIET ) ) {
+			if ( ! ( x->flags & QUIET ) )
+				printError(x->archive, "Cannot read file", SFileName, GetLastError());
 
-						printError(archive, "Cannot create directory", fileDir, errno);
-						printError(archive, "Cannot extract file", fileName, ENOENT);
+			return 0;
 
-					}
+		}
 
-					goto next;
+	}
 
-				}
+	if ( x->flags & VERBOSE ) {
 
-			}
+		char message[128];
+		DWORD fileFlags = 0;
+		unsigned long long int sectors = 1;
+		unsigned long long int touched = ( length != 0 );
 
-			if ( stat(fileName, &st) != -1 ) {
+		SFileGetFileInfo(SFile, SFileInfoFlags, &fileFlags, sizeof(fileFlags), NULL);
 
-				if ( ! ( flags & OVERWRITE ) ) {
+		if ( ! ( fileFlags & MPQ_FILE_SINGLE_UNIT ) && x->sectorSize != 0 ) {
 
-					if ( ! ( flags & QUIET ) )
-						printError(archive, "Cannot extract file", fileName, EEXIST);
+			sectors = ( size + x->sectorSize - 1 ) / x->sectorSize;
 
-					goto next;
+			if ( length != 0 )
+				touched = ( x->rangeOffset + length - 1 ) / x->sectorSize - x->rangeOffset / x->sectorSize + 1;
 
-				}
+		}
 
-				if ( S_ISDIR(st.st_mode) ) {
+		sprintf(message, "Range has %llu bytes in %llu of %llu sectors", length, touched, sectors);
+		printVerbose(x->archive, message, fileName);
 
-					if ( ! ( flags & QUIET ) )
-						printError(archive, "Cannot extract file", fileName, EISDIR);
+	}
 
-					goto next;
+	return length;
 
-				}
+}
 
-				if ( flags & VERBOSE )
-					printVerbose(archive, "Remove old file", fileName);
+/* Write one file from archive to stream, with flag FRAMED as record with name and length or to tar archive */
+static void extractToStream(struct extraction * x, HANDLE SArchive, const char * SFileName, unsigned long long int SFileTime) {
 
-				if ( unlink(fileName) != 0 ) {
+	char fileName[1024];
+	time_t fileTime = 0;
+	HANDLE SFile = NULL;
+	unsigned long long int size;
+	unsigned long long int written;
 
-					if ( ! ( flags & QUIET ) )
-						printError(archive, "Cannot remove existing file", fileName, errno);
+	fromArchivePath(fileName, SFileName);
 
-					goto next;
+	if ( ! fromFileTime(&fileTime, SFileTime) )
+		fileTime = 0;
 
-				}
+	if ( ! SFileOpenFileEx(SArchive, SFileName, SFILE_OPEN_FROM_MPQ, &SFile) ) {
 
-			}
+		if ( ! ( x->flags & QUIET ) )
+			printError(x->archive, "Cannot open file in archive", SFileName, GetLastError());
 
-			file  = fopen(fileName, "wb");
+		return;
 
-			if ( ! file ) {
+	}
 
-				if ( ! ( flags & QUIET ) )
-					printError(archive, "Cannot open file", fileName, errno);
+	if ( x->flags & VERBOSE )
+		printVerbose(x->archive, "Extract", fileName);
 
-				goto next;
+	size = seekRange(x, SFile, SFileName, fileName);
 
-			}
+	if ( ! x->tar && ! ( x->flags & FRAMED ) ) {
 
-			while ( 1 ) {
+		writeData(x, SFile, SFileName, x->streamName, x->stream, size);
+		SFileCloseFile(SFile);
+		return;
 
-				int eof = 0;
+	}
 
-				if ( ! SFileReadFile(SFile, buffer, sizeof(buffer), (DWORD *)&bytes, NULL) ) {
+	if ( x->tar ) {
 
-					eof = ( GetLastError() == ERROR_HANDLE_EOF );
+		if ( writeTarHeader(x->stream, fileName, size, fileTime) == -1 ) {
 
-					if ( ! eof ) {
+			if ( ! ( x->flags & QUIET ) )
+				printError(x->archive, "Cannot write file", x->streamName, errno);
 
-						if ( ! ( flags & QUIET ) )
-							printError(archive, "Cannot read file", SFileName, GetLastError());
+			SFileCloseFile(SFile);
+			return;
 
-						break;
+		}
 
-					}
+	} else {
 
-				}
+		unsigned char header[8];
 
-				if ( fwrite(buffer, 1, bytes, file) != bytes ) {
+		littleEndian(header, strlen(fileName), 4);
+		fwrite(header, 1, 4, x->stream);
+		fwrite(fileName, 1, strlen(fileName), x->stream);
+		littleEndian(header, size, 8);
+		fwrite(header, 1, 8, x->stream);
 
-					if ( ! ( flags & QUIET ) )
-						printError(archive, "Cannot write file", fileName, errno);
+	}
 
-					break;
+	written = writeData(x, SFile, SFileName, x->streamName, x->stream, size);
 
-				}
+	/* Reader expects data length from header, so record must be complete */
+	for ( ; written < size; ++written )
+		fputc(0, x->stream);
 
-				if ( eof )
-					break;
+	if ( x->tar )
+		writeTarPadding(x->stream, size);
 
-			}
+	SFileCloseFile(SFile);
 
-			fclose(file);
+}
 
-			{
-				struct utimbuf fileTimeBuf = { fileTime, fileTime };
-				utime(fileName, &fileTimeBuf);
-			}
+#ifdef HAVE_OPENAT
 
-next:
-			if ( SFile )
-				SFileCloseFile(SFile);
+/**
+ * Copy data of stored file from archive file to created file, return -1 on error
+ *
+ * Data are cloned (FICLONERANGE) when filesystem supports it and range is aligned, otherwise copied inside kernel by
+ * copy_file_range. When both are not possible (e.g. different filesystems), data are copied by pread and write.
+ */
+static int copyStored(struct extraction * x, int fd, const char * SFileName, const char * fileName, unsigned long long int offset, unsigned int size) {
 
-			if ( SFileFind == (HANDLE)0xFFFFFFFF )
-				break;
+	unsigned long long int in = x->headerOffset + offset;
+	unsigned int written = 0;
+	char buffer[0x10000];
 
-			if ( ! SFileFindNextFile(SFileFind, &SFileFindData) )
-				break;
+#ifdef FICLONERANGE
+	if ( size != 0 && in % 4096 == 0 && size % 4096 == 0 ) {
 
-		}
+		struct file_clone_range range;
 
-		trie_free(t);
+		range.src_fd = x->archiveFd;
+		range.src_offset = in;
+		range.src_length = size;
+		range.dest_offset = 0;
 
-		if ( SFileFind != (HANDLE)0xFFFFFFFF )
-			SFileFindClose(SFileFind);
+		if ( ioctl(fd, FICLONERANGE, &range) == 0 && lseek(fd, size, SEEK_SET) == (off_t)size )
+			return 0;
 
 	}
+#endif
 
-	SFileCloseArchive(SArchive);
+#ifdef HAVE_COPY_FILE_RANGE
+	while ( written < size ) {
+
+		loff_t inOffset = in + written;
+		ssize_t bytes = copy_file_range(x->archiveFd, &inOffset, fd, NULL, size - written, 0);
+
+		if ( bytes <= 0 )
+			break;
+
+		written += bytes;
+
+	}
+#endif
+
+	while ( written < size ) {
+
+		size_t length = size - written < sizeof(buffer) ? size - written : sizeof(buffer);
+		ssize_t bytes = pread(x->archiveFd, buffer, length, in + written);
+
+		if ( bytes <= 0 ) {
+
+			if ( ! ( x->flags & QUIET ) )
+				printError(x->archive, "Cannot read file", SFileName, bytes < 0 ? errno : EIO);
+
+			return -1;
+
+		}
+
+		if ( write(fd, buffer, bytes) != bytes ) {
+
+			if ( ! ( x->flags & QUIET ) )
+				printError(x->archive, "Cannot write file", fileName, errno);
+
+			return -1;
+
+		}
+
+		written += bytes;
+
+	}
+
+	return 0;
+
+}
+
+#endif
+
+/**
+ * Return offset of data of opened file which can be copied directly from archive file or ~0 when data must be read by StormLib
+ *
+ * Everything is taken from opened file, not from search: name can be in more locales and opened file can have other block.
+ */
+static unsigned long long int storedDataOffset(const struct extraction * x, HANDLE SFile) {
+
+#ifdef HAVE_OPENAT
+	unsigned long long int offset;
+	unsigned int fileFlags;
+	unsigned int fileSize;
+	unsigned int compressedSize;
+
+	/* Patch files have patch header and sector checksums are verified only by StormLib */
+	if ( x->archiveFd == -1 || x->stream || ( x->flags & SECTOR_CRC ) )
+		return ~0ULL;
+
+	if ( ! SFileGetFileInfo(SFile, SFileInfoByteOffset, &offset, sizeof(offset), NULL) || ! SFileGetFileInfo(SFile, SFileInfoFlags, &fileFlags, sizeof(fileFlags), NULL) )
+		return ~0ULL;
+
+	if ( ! SFileGetFileInfo(SFile, SFileInfoFileSize, &fileSize, sizeof(fileSize), NULL) || ! SFileGetFileInfo(SFile, SFileInfoCompressedSize, &compressedSize, sizeof(compressedSize), NULL) )
+		return ~0ULL;
+
+	if ( ! ( fileFlags & MPQ_FILE_EXISTS ) || ( fileFlags & ( MPQ_FILE_COMPRESS_MASK | MPQ_FILE_ENCRYPTED | MPQ_FILE_PATCH_FILE | MPQ_FILE_DELETE_MARKER ) ) )
+		return ~0ULL;
+
+	if ( compressedSize < fileSize )
+		return ~0ULL;
+
+	return offset;
+#else
+	(void)x;
+	(void)SFile;
+
+	return ~0ULL;
+#endif
+
+}
+
+/**
+ * Extract one file from archive
+ *
+ * Data of stored file (without compression and encryption) are copied directly from archive file at offset returned by
+ * storedDataOffset. File in archive is still opened for checking of existing file.
+ */
+static void extractFile(struct extraction * x, HANDLE SArchive, const char * SFileName, unsigned long long int SFileTime) {
+
+	const char * archive = x->archive;
+	unsigned int flags = x->flags;
+
+	struct stat st;
+	char fileName[1024];
+	char fileDir[1024];
+	time_t fileTime = 0;
+
+	HANDLE SFile = NULL;
+	unsigned long long int size;
+	unsigned long long int storedOffset;
+
+	int j;
+	int last = 0;
+
+	/* Directory of file (cached descriptor or current directory) and name of file relative to it */
+	int dirFd = AT_FDCWD;
+	const char * name = fileName;
+	int ret = 0;
+#ifdef HAVE_OPENAT
+	int fd;
+#else
+	FILE * file = NULL;
+#endif
+
+	fromArchivePath(fileName, SFileName);
+
+	if ( ! fromFileTime(&fileTime, SFileTime) )
+		fileTime = 0;
+
+	if ( ! SFileOpenFileEx(SArchive, SFileName, SFILE_OPEN_FROM_MPQ, &SFile) ) {
+
+		if ( ! ( flags & QUIET ) )
+			printError(archive, "Cannot open file in archive", SFileName, GetLastError());
+
+		return;
+
+	}
+
+	storedOffset = storedDataOffset(x, SFile);
+
+	j = -1;
+
+	while ( SFileName[++j] )
+		if ( SFileName[j] == '\\' )
+			last = j;
+
+	if ( flags & VERBOSE )
+		printVerbose(archive, "Extract", fileName);
+
+	size = seekRange(x, SFile, SFileName, fileName);
+
+	memcpy(fileDir, fileName, last);
+	fileDir[last] = 0;
+
+	if ( last != 0 ) {
+
+		int ret;
+
+#ifdef HAVE_PTHREAD
+		pthread_mutex_lock(&x->mutex);
+#endif
+#ifdef HAVE_OPENAT
+		ret = dirFd = openDirectory(x, fileDir);
+#else
+		ret = mkpath(fileDir);
+#endif
+#ifdef HAVE_PTHREAD
+		pthread_mutex_unlock(&x->mutex);
+#endif
+
+		/* Name of file relative to descriptor of its directory */
+		if ( ret != -1 && dirFd != AT_FDCWD )
+			name = fileName + last + 1;
+
+		if ( ret == -1 ) {
+
+			if ( ! ( flags & QUIET ) ) {
+
+				printError(archive, "Cannot create directory", fileDir, errno);
+				printError(archive, "Cannot extract file", fileName, ENOENT);
+
+			}
+
+			goto out;
+
+		}
+
+	}
+
+	if ( fstatat(dirFd, name, &st, 0) != -1 ) {
+
+		if ( ( flags & UPDATE ) && ! S_ISDIR(st.st_mode) ) {
+
+			int unchanged = unchangedFile(x, SFile, dirFd, name, &st, size, fileTime);
+
+#ifdef HAVE_PTHREAD
+			pthread_mutex_lock(&x->mutex);
+#endif
+			if ( unchanged ) {
+
+				++x->skippedFiles;
+				x->skippedBytes += size;
+
+			} else {
+
+				++x->rewrittenFiles;
+
+			}
+#ifdef HAVE_PTHREAD
+			pthread_mutex_unlock(&x->mutex);
+#endif
+
+			if ( unchanged ) {
+
+				if ( flags & VERBOSE )
+					printVerbose(archive, "Skip unchanged file", fileName);
+
+				goto out;
+
+			}
+
+		}
+
+		if ( ! ( flags & ( OVERWRITE | UPDATE ) ) ) {
+
+			if ( ! ( flags & QUIET ) )
+				printError(archive, "Cannot extract file", fileName, EEXIST);
+
+			goto out;
+
+		}
+
+		if ( S_ISDIR(st.st_mode) ) {
+
+			if ( ! ( flags & QUIET ) )
+				printError(archive, "Cannot extract file", fileName, EISDIR);
+
+			goto out;
+
+		}
+
+		if ( flags & VERBOSE )
+			printVerbose(archive, "Remove old file", fileName);
+
+		if ( unlinkat(dirFd, name, 0) != 0 ) {
+
+			if ( ! ( flags & QUIET ) )
+				printError(archive, "Cannot remove existing file", fileName, errno);
+
+			goto out;
+
+		}
+
+	}
+
+#ifdef HAVE_ASYNC_WRITER
+	/* Decompression continues with next file while writer creates this one */
+	if ( x->writer && storedOffset == ~0ULL && size <= ASYNC_WRITE_MAX && submitFile(x, SFile, SFileName, dirFd, name, fileName, size, fileTime) == 0 )
+		goto out;
+#endif
+
+#ifdef HAVE_OPENAT
+	fd = openat(dirFd, name, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+
+	if ( fd == -1 ) {
+
+		if ( ! ( flags & QUIET ) )
+			printError(archive, "Cannot open file", fileName, errno);
+
+		goto out;
+
+	}
+
+	/* Stored data do not need StormLib, they are copied from archive file */
+	if ( storedOffset != ~0ULL )
+		ret = copyStored(x, fd, SFileName, fileName, storedOffset + x->rangeOffset, size);
+	else
+		ret = writeSparseData(x, SFile, SFileName, fileName, fd, size);
+
+	if ( close(fd) != 0 && ret == 0 ) {
+
+		if ( ! ( flags & QUIET ) )
+			printError(archive, "Cannot write file", fileName, errno);
+
+		ret = -1;
+
+	}
+#else
+	file  = fopen(fileName, "wb");
+
+	if ( ! file ) {
+
+		if ( ! ( flags & QUIET ) )
+			printError(archive, "Cannot open file", fileName, errno);
+
+		goto out;
+
+	}
+
+	if ( writeData(x, SFile, SFileName, fileName, file, size) != size )
+		ret = -1;
+
+	if ( fclose(file) != 0 && ret == 0 ) {
+
+		if ( ! ( flags & QUIET ) )
+			printError(archive, "Cannot write file", fileName, errno);
+
+		ret = -1;
+
+	}
+#endif
+
+	/* Incomplete file keeps current time, so it is not skipped as unchanged by next update */
+	if ( ret != 0 )
+		goto out;
+
+#ifdef HAVE_OPENAT
+	{
+		struct timespec fileTimes[2];
+		fileTimes[0].tv_sec = fileTime;
+		fileTimes[0].tv_nsec = 0;
+		fileTimes[1] = fileTimes[0];
+		utimensat(dirFd, name, fileTimes, 0);
+	}
+#else
+	{
+		struct utimbuf fileTimeBuf = { fileTime, fileTime };
+		utime(fileName, &fileTimeBuf);
+	}
+#endif
+
+out:
+	SFileCloseFile(SFile);
+
+}
+
+/* Add file to found files, return -1 on error */
+static int addFound(struct foundFiles * f, const char * SFileName, unsigned int compressedSize, unsigned long long int offset, unsigned long long int SFileTime) {
+
+	size_t length = strlen(SFileName) + 1;
+	struct found * file;
+
+	if ( f->count == f->size ) {
+
+		unsigned int size = f->size ? f->size * 2 : 256;
+		struct found * files = (struct found *)realloc(f->files, size * sizeof(struct found));
+
+		if ( ! files )
+			return -1;
+
+		f->files = files;
+		f->size = size;
+
+	}
+
+	if ( f->namesUsed + length > f->namesSize ) {
+
+		size_t size = f->namesSize ? f->namesSize * 2 : 0x10000;
+		char * names;
+
+		while ( size < f->namesUsed + length )
+			size *= 2;
+
+		names = (char *)realloc(f->names, size);
+
+		if ( ! names )
+			return -1;
+
+		f->names = names;
+		f->namesSize = size;
+
+	}
+
+	file = &f->files[f->count++];
+	file->name = f->namesUsed;
+	file->compressedSize = compressedSize;
+	file->offset = offset;
+	file->SFileTime = SFileTime;
+
+	memcpy(f->names + f->namesUsed, SFileName, length);
+	f->namesUsed += length;
+
+	return 0;
+
+}
+
+/* Order by offset in archive, files with unknown offset are last, otherwise keep order in which they were found */
+static int compareFound(const void * a, const void * b) {
+
+	const struct found * x = (const struct found *)a;
+	const struct found * y = (const struct found *)b;
+
+	if ( x->offset != y->offset )
+		return x->offset < y->offset ? -1 : 1;
+
+	if ( x->name != y->name )
+		return x->name < y->name ? -1 : 1;
 
 	return 0;
 
 }
+
+/* Count backward jumps from end of block to start of next block when found files are read in current order, unknown offsets are skipped */
+static void countSeeks(const struct foundFiles * f, unsigned int * seeks, unsigned long long int * seekBytes) {
+
+	unsigned long long int end = ~0ULL;
+	unsigned int i;
+
+	for ( i = 0; i < f->count; ++i ) {
+
+		const struct found * file = &f->files[i];
+
+		if ( file->offset == ~0ULL )
+			continue;
+
+		if ( end != ~0ULL && file->offset < end ) {
+
+			++*seeks;
+			*seekBytes += end - file->offset;
+
+		}
+
+		end = file->offset + file->compressedSize;
+
+	}
+
+}
+
+#ifdef HAVE_FADVISE
+
+/**
+ * Ask kernel to read archive range of files ahead of extracted file, return index of first file which was not advised
+ *
+ * StormLib reads archive by own descriptor, but page cache is shared, so hints for second descriptor of same file work too.
+ * Adjacent files are merged to one range, so sequentially stored files need only few syscalls.
+ */
+static unsigned int adviseFound(const struct foundFiles * f, unsigned int current, unsigned int advised, int fd, unsigned long long int headerOffset) {
+
+	unsigned long long int limit = f->files[current].offset + READAHEAD_WINDOW;
+	unsigned long long int start = 0;
+	unsigned long long int end = 0;
+	int pending = 0;
+
+	for ( ; advised < f->count; ++advised ) {
+
+		const struct found * file = &f->files[advised];
+
+		if ( file->offset == ~0ULL ) {
+
+			advised = f->count;
+			break;
+
+		}
+
+		if ( advised > current && file->offset >= limit )
+			break;
+
+		if ( pending && file->offset > end ) {
+
+			posix_fadvise(fd, headerOffset + start, end - start, POSIX_FADV_WILLNEED);
+			pending = 0;
+
+		}
+
+		if ( ! pending ) {
+
+			start = end = file->offset;
+			pending = 1;
+
+		}
+
+		if ( file->offset + file->compressedSize > end )
+			end = file->offset + file->compressedSize;
+
+	}
+
+	if ( pending && end != start )
+		posix_fadvise(fd, headerOffset + start, end - start, POSIX_FADV_WILLNEED);
+
+	return advised;
+
+}
+
+#endif
+
+#ifdef HAVE_PTHREAD
+
+/* File waiting for extraction by worker thread */
+struct job {
+
+	char SFileName[1024];
+	unsigned long long int SFileTime;
+
+};
+
+/* Queue of files for worker threads, main thread finds files and workers extract them */
+struct queue {
+
+	struct extraction * x;
+
+	struct job * jobs;
+	unsigned int size;
+	unsigned int head;
+	unsigned int tail;
+	int end;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+};
+
+/* Worker thread has own archive handle, StormLib handle can be used only from one thread */
+struct worker {
+
+	struct queue * q;
+	HANDLE SArchive;
+	pthread_t thread;
+
+};
+
+static void * extractWorker(void * arg) {
+
+	struct worker * w = (struct worker *)arg;
+	struct queue * q = w->q;
+	struct job job;
+
+	pthread_mutex_lock(&q->mutex);
+
+	while ( 1 ) {
+
+		while ( ! q->end && q->head == q->tail )
+			pthread_cond_wait(&q->cond, &q->mutex);
+
+		if ( q->head == q->tail )
+			break;
+
+		job = q->jobs[q->head % q->size];
+		++q->head;
+		pthread_cond_broadcast(&q->cond);
+
+		pthread_mutex_unlock(&q->mutex);
+		extractFile(q->x, w->SArchive, job.SFileName, job.SFileTime);
+		pthread_mutex_lock(&q->mutex);
+
+	}
+
+	pthread_mutex_unlock(&q->mutex);
+
+	return NULL;
+
+}
+
+/* Add file to queue, wait when queue is full */
+static void addJob(struct queue * q, const char * SFileName, unsigned long long int SFileTime) {
+
+	struct job * job;
+
+	pthread_mutex_lock(&q->mutex);
+
+	while ( q->tail - q->head >= q->size )
+		pthread_cond_wait(&q->cond, &q->mutex);
+
+	job = &q->jobs[q->tail % q->size];
+	strcpy(job->SFileName, SFileName);
+	job->SFileTime = SFileTime;
+	++q->tail;
+
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->mutex);
+
+}
+
+/* Open archive handles and start worker threads, return number of started workers */
+static unsigned int startWorkers(struct queue * q, struct worker * workers, unsigned int jobs, unsigned int SFlags, const char * const parchives[]) {
+
+	unsigned int started;
+
+	q->size = jobs * 4;
+	q->head = 0;
+	q->tail = 0;
+	q->end = 0;
+	q->jobs = (struct job *)malloc(q->size * sizeof(struct job));
+
+	if ( ! q->jobs )
+		return 0;
+
+	pthread_mutex_init(&q->mutex, NULL);
+	pthread_cond_init(&q->cond, NULL);
+
+	/* Workers open files by name, so they do not need listfile */
+	for ( started = 0; started < jobs; ++started ) {
+
+		workers[started].q = q;
+		workers[started].SArchive = openArchive(q->x->archive, q->x->flags & ~VERBOSE, SFlags | MPQ_OPEN_NO_LISTFILE, parchives);
+
+		if ( ! workers[started].SArchive )
+			break;
+
+		if ( pthread_create(&workers[started].thread, NULL, extractWorker, &workers[started]) != 0 ) {
+
+			SFileCloseArchive(workers[started].SArchive);
+			break;
+
+		}
+
+	}
+
+	if ( started == 0 ) {
+
+		pthread_cond_destroy(&q->cond);
+		pthread_mutex_destroy(&q->mutex);
+		free(q->jobs);
+
+	}
+
+	return started;
+
+}
+
+/* Wait until all files in queue are extracted and stop worker threads */
+static void stopWorkers(struct queue * q, struct worker * workers, unsigned int started) {
+
+	unsigned int i;
+
+	pthread_mutex_lock(&q->mutex);
+	q->end = 1;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->mutex);
+
+	for ( i = 0; i < started; ++i ) {
+
+		pthread_join(workers[i].thread, NULL);
+		SFileCloseArchive(workers[i].SArchive);
+
+	}
+
+	pthread_cond_destroy(&q->cond);
+	pthread_mutex_destroy(&q->mutex);
+	free(q->jobs);
+
+}
+
+#endif
+
+/* Extract file by current thread or pass it to worker threads */
+static void extractFound(struct extraction * x, HANDLE SArchive, const char * SFileName, unsigned long long int SFileTime) {
+
+#ifdef HAVE_PTHREAD
+	if ( x->queue ) {
+
+		addJob(x->queue, SFileName, SFileTime);
+		return;
+
+	}
+#endif
+
+	if ( x->stream )
+		extractToStream(x, SArchive, SFileName, SFileTime);
+	else
+		extractFile(x, SArchive, SFileName, SFileTime);
+
+}
+
+/* Extract found files in order of their offsets in archive, return number of extracted files */
+static unsigned int extractFoundFiles(struct extraction * x, HANDLE SArchive, struct foundFiles * found, const struct blocktable * table) {
+
+	unsigned int i;
+#ifdef HAVE_FADVISE
+	unsigned int advised = 0;
+#endif
+
+	if ( x->flags & VERBOSE )
+		countSeeks(found, &x->foundSeeks, &x->foundSeekBytes);
+
+	/* Files are read in order of their blocks, so archive is read sequentially instead of seeking in order of hash table */
+	if ( table->blocks && found->count > 1 )
+		qsort(found->files, found->count, sizeof(struct found), compareFound);
+
+	if ( x->flags & VERBOSE )
+		countSeeks(found, &x->readSeeks, &x->readSeekBytes);
+
+	for ( i = 0; i < found->count; ++i ) {
+
+		const struct found * file = &found->files[i];
+
+#ifdef HAVE_FADVISE
+		/* Next range is advised when less than half of window is ahead, so each hint covers at least half of window */
+		if ( x->archiveFd != -1 && advised < found->count && ( i >= advised || found->files[advised].offset < file->offset + READAHEAD_WINDOW / 2 ) )
+			advised = adviseFound(found, i, advised, x->archiveFd, x->headerOffset);
+#endif
+
+		extractFound(x, SArchive, found->names + file->name, file->SFileTime);
+
+	}
+
+	return found->count;
+
+}
+
+/**
+ * Extract files with exact names listed in file (one name per line) or stdin, return number of extracted files
+ *
+ * Each name is looked up directly in hash table of archive by SFileOpenFileEx, so no listfile is needed and cost
+ * depends only on number of names, not on number of files in archive. Names which are not in archive are reported
+ * together after all found files are extracted and extraction then returns error.
+ */
+static unsigned int extractNames(struct extraction * x, HANDLE SArchive, const char * namesFile, struct nameset * names, struct foundFiles * found, const struct blocktable * table) {
+
+	FILE * file;
+	char line[1024+2];
+	struct foundFiles missing;
+	unsigned int extracted = 0;
+	unsigned int i;
+
+	if ( strcmp(namesFile, "-") == 0 )
+		file = stdin;
+	else
+		file = fopen(namesFile, "r");
+
+	if ( ! file ) {
+
+		if ( ! ( x->flags & QUIET ) )
+			printError(x->archive, "Cannot open names file", namesFile, errno);
+
+		x->namesFailed = 1;
+		return 0;
+
+	}
+
+	memset(&missing, 0, sizeof(missing));
+	nameset_clear(names);
+	found->count = 0;
+	found->namesUsed = 0;
+
+	while ( fgets(line, sizeof(line), file) ) {
+
+		char SFileName[1024+2];
+		HANDLE SFile;
+		unsigned int compressedSize = 0;
+		unsigned int blockIndex = 0xFFFFFFFF;
+		unsigned long long int SFileTime = 0;
+
+		line[strcspn(line, "\r\n")] = 0;
+
+		if ( line[0] == 0 )
+			continue;
+
+		toArchivePath(SFileName, line);
+
+		if ( nameset_add(names, SFileName, 0) == 0 )
+			continue;
+
+		if ( strlen(SFileName)+1 > 1024 || ! SFileOpenFileEx(SArchive, SFileName, SFILE_OPEN_FROM_MPQ, &SFile) ) {
+
+			if ( addFound(&missing, line, 0, ~0ULL, 0) == -1 && ! ( x->flags & QUIET ) )
+				printError(x->archive, "Cannot find file in archive", line, ENOENT);
+
+			continue;
+
+		}
+
+		SFileGetFileInfo(SFile, SFileInfoCompressedSize, &compressedSize, sizeof(compressedSize), NULL);
+		SFileGetFileInfo(SFile, SFileInfoFileIndex, &blockIndex, sizeof(blockIndex), NULL);
+		SFileGetFileInfo(SFile, SFileInfoFileTime, &SFileTime, sizeof(SFileTime), NULL);
+
+		SFileCloseFile(SFile);
+
+		/* Without memory file is extracted immediately */
+		if ( addFound(found, SFileName, compressedSize, blockOffset(table, blockIndex), SFileTime) == -1 ) {
+
+			extractFound(x, SArchive, SFileName, SFileTime);
+			++extracted;
+
+		}
+
+	}
+
+	if ( ferror(file) ) {
+
+		if ( ! ( x->flags & QUIET ) )
+			printError(x->archive, "Cannot read names file", namesFile, errno);
+
+		x->namesFailed = 1;
+
+	}
+
+	if ( file != stdin )
+		fclose(file);
+
+	extracted += extractFoundFiles(x, SArchive, found, table);
+
+	if ( missing.count != 0 )
+		x->namesFailed = 1;
+
+	if ( missing.count != 0 && ! ( x->flags & QUIET ) ) {
+
+		char message[128];
+		sprintf(message, "Cannot find %u files listed in", missing.count);
+		printError(x->archive, message, namesFile, ENOENT);
+
+		for ( i = 0; i < missing.count; ++i )
+			printError(x->archive, "Cannot find file in archive", missing.names + missing.files[i].name, ENOENT);
+
+	}
+
+	free(missing.files);
+	free(missing.names);
+
+	return extracted;
+
+}
+
+int smpq_extract(const char * archive, const char * const files[], unsigned int flags, const char * listfile, unsigned int locale, const char * const parchives[], const struct smpq_options * options) {
+
+	int i;
+	HANDLE SArchive = NULL;
+	unsigned int fileCount;
+	struct nameset names;
+	struct extraction x;
+	struct foundFiles found;
+	struct blocktable table;
+	unsigned long long int start = getTime();
+	unsigned int extracted = 0;
+
+#ifdef HAVE_PTHREAD
+	struct queue q;
+	struct worker * workers = NULL;
+	unsigned int started = 0;
+#endif
+
+	unsigned int SFlags = STREAM_FLAG_READ_ONLY;
+
+	/* Names from names file are looked up in hash table, so listfiles are needed only for file masks */
+	if ( options->names && ! files[0] )
+		flags |= NO_LISTFILE | NO_SYSTEM_LF;
+
+	if ( flags & NO_LISTFILE )
+		SFlags |= MPQ_OPEN_NO_LISTFILE;
+
+	if ( flags & NO_ATTRIBUTES )
+		SFlags |= MPQ_OPEN_NO_ATTRIBUTES;
+
+	if ( flags & MPQ_VERSION_1 )
+		SFlags |= MPQ_OPEN_FORCE_MPQ_V1;
+
+	if ( flags & SECTOR_CRC )
+		SFlags |= MPQ_OPEN_CHECK_SECTOR_CRC;
+
+	if ( flags & MPQ_PARTIAL )
+		SFlags |= STREAM_PROVIDER_PARTIAL;
+
+	if ( flags & MPQ_ENCRYPTED )
+		SFlags |= STREAM_PROVIDER_MPQE;
+
+	SArchive = openArchive(archive, flags, SFlags, parchives);
+
+	if ( ! SArchive )
+		return -1;
+
+	if ( ! ( flags & NO_SYSTEM_LF ) )
+		smpq_systemlistfiles(SArchive, archive, flags);
+
+	if ( ! ( flags & NO_LISTFILE ) )
+		SFileAddListFile(SArchive, NULL);
+
+	SFileSetLocale(locale);
+
+	if ( ! SFileGetFileInfo(SArchive, SFileMpqNumberOfFiles, &fileCount, sizeof(fileCount), NULL) )
+		fileCount = 0;
+
+	x.archive = archive;
+	x.flags = flags;
+	x.skippedFiles = 0;
+	x.skippedBytes = 0;
+	x.rewrittenFiles = 0;
+	x.namesFailed = 0;
+	x.foundSeeks = 0;
+	x.foundSeekBytes = 0;
+	x.readSeeks = 0;
+	x.readSeekBytes = 0;
+	x.rangeOffset = options->rangeOffset;
+	x.rangeLength = options->rangeLength;
+	x.stream = NULL;
+	x.streamName = NULL;
+	x.tar = ( options->tar != NULL );
+
+	if ( ! SFileGetFileInfo(SArchive, SFileMpqSectorSize, &x.sectorSize, sizeof(x.sectorSize), NULL) )
+		x.sectorSize = 0;
+
+	if ( ( flags & TO_STDOUT ) || ( x.tar && strcmp(options->tar, "-") == 0 ) ) {
+
+#if defined(WIN32) || defined(_MSC_VER)
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		x.stream = stdout;
+		x.streamName = "stdout";
+
+	} else if ( x.tar ) {
+
+		x.stream = fopen(options->tar, "wb");
+		x.streamName = options->tar;
+
+		if ( ! x.stream ) {
+
+			if ( ! ( flags & QUIET ) )
+				printError(archive, "Cannot open file", options->tar, errno);
+
+			SFileCloseArchive(SArchive);
+			return -1;
+
+		}
+
+	}
+
+	nameset_init(&names, fileCount);
+
+#ifdef HAVE_OPENAT
+	nameset_init(&x.dirs, 0);
+	x.dirFds = 0;
+	x.archiveFd = -1;
+	x.headerOffset = 0;
+#endif
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&x.mutex, NULL);
+	x.queue = NULL;
+#endif
+#ifdef HAVE_ASYNC_WRITER
+	x.writer = NULL;
+
+	if ( ! x.stream )
+		x.writer = writer_open(archive, flags, options->jobs);
+#endif
+
+#ifdef HAVE_PTHREAD
+	/* Data in stream must be in order of files */
+	if ( options->jobs > 1 && ! x.stream ) {
+
+		q.x = &x;
+
+		workers = (struct worker *)calloc(options->jobs, sizeof(struct worker));
+
+		if ( workers )
+			started = startWorkers(&q, workers, options->jobs, SFlags, parchives);
+
+		if ( started != 0 )
+			x.queue = &q;
+
+		if ( started != 0 && ( flags & VERBOSE ) )
+			printVerbose(archive, "Use parallel workers for extracting files", archive);
+
+	}
+#else
+	(void)options;
+#endif
+
+	memset(&found, 0, sizeof(found));
+	memset(&table, 0, sizeof(table));
+
+	/* Block indexes of files from patched archives are not indexes to block table of base archive */
+	if ( ! parchives[0] )
+		readBlockTable(&table, SArchive);
+
+#ifdef HAVE_OPENAT
+	/* Stream providers for partial and encrypted archives do not map offsets in archive to offsets in file */
+	if ( table.blocks && ! ( flags & ( MPQ_PARTIAL | MPQ_ENCRYPTED ) ) ) {
+
+		if ( ! SFileGetFileInfo(SArchive, SFileMpqHeaderOffset, &x.headerOffset, sizeof(x.headerOffset), NULL) )
+			x.headerOffset = 0;
+
+		x.archiveFd = open(archive, O_RDONLY | O_BINARY);
+
+	}
+#endif
+
+	for ( i = 0; files[i]; ++i ) {
+
+		char mask[512];
+
+		SFILE_FIND_DATA SFileFindData;
+		HANDLE SFileFind = NULL;
+
+		toArchivePath(mask, files[i]);
+
+		SFileFind = SFileFindFirstFile(SArchive, mask, &SFileFindData, listfile);
+
+		if ( ! SFileFind ) {
+
+			HANDLE SFile;
+
+			SFileFind = (HANDLE)0xFFFFFFFF;
+			SFileFindData.dwFileTimeLo = 0;
+			SFileFindData.dwFileTimeHi = 0;
+			SFileFindData.dwBlockIndex = 0xFFFFFFFF;
+			SFileFindData.dwCompSize = 0;
+			SFileFindData.dwFileFlags = 0;
+
+			strcpy(SFileFindData.cFileName, mask);
+
+			if ( SFileOpenFileEx(SArchive, mask, SFILE_OPEN_FROM_MPQ, &SFile) ) {
+
+				unsigned int high = 0;
+				unsigned int low = SFileGetFileSize(SFile, (DWORD*)&high);
+
+				SFileGetFileName(SFile, mask);
+
+				SFileFindData.dwFileSize = low | ( (unsigned long long int)high << 32 );
+
+				SFileCloseFile(SFile);
+
+			}
+
+		}
+
+		nameset_clear(&names);
+		found.count = 0;
+		found.namesUsed = 0;
+
+		/* Files are found and checked for duplicates only in this thread, workers only extract them */
+		while ( SFileFind ) {
+
+			const char * SFileName = SFileFindData.cFileName;
+			unsigned long long int SFileTime = SFileFindData.dwFileTimeLo | ( ((unsigned long long int)SFileFindData.dwFileTimeHi) << 32 );
+
+			if ( strlen(SFileFindData.cFileName)+1 > 1024 )
+				goto next;
+
+			if ( strcmp(SFileName, "(listfile)") == 0 || strcmp(SFileName, "(signature)") == 0 || strcmp(SFileName, "(attributes)") == 0 || strstr(SFileName, "(patch_metadata)") != NULL )
+				goto next;
+
+			if ( nameset_add(&names, SFileName, 0) == 0 )
+				goto next;
+
+			/* Without memory file is extracted immediately */
+			if ( addFound(&found, SFileName, SFileFindData.dwCompSize, blockOffset(&table, SFileFindData.dwBlockIndex), SFileTime) == -1 ) {
+
+				extractFound(&x, SArchive, SFileName, SFileTime);
+				++extracted;
+
+			}
+
+next:
+			if ( SFileFind == (HANDLE)0xFFFFFFFF )
+				break;
+
+			if ( ! SFileFindNextFile(SFileFind, &SFileFindData) )
+				break;
+
+		}
+
+		if ( SFileFind != (HANDLE)0xFFFFFFFF )
+			SFileFindClose(SFileFind);
+
+		extracted += extractFoundFiles(&x, SArchive, &found, &table);
+
+	}
+
+	if ( options->names )
+		extracted += extractNames(&x, SArchive, options->names, &names, &found, &table);
+
+#ifdef HAVE_PTHREAD
+	if ( started != 0 )
+		stopWorkers(&q, workers, started);
+
+	free(workers);
+#endif
+#ifdef HAVE_ASYNC_WRITER
+	if ( x.writer )
+		writer_close(x.writer);
+#endif
+
+	if ( flags & VERBOSE ) {
+
+		char message[128];
+		start = getTime() - start;
+		sprintf(message, "Extracted %u files in %llu.%03llu s", extracted, start / 1000000000ULL, start / 1000000ULL % 1000);
+		printVerbose(archive, message, archive);
+		sprintf(message, "Read archive with %u backward seeks (%llu bytes), order of hash table needs %u (%llu bytes)", x.readSeeks, x.readSeekBytes, x.foundSeeks, x.foundSeekBytes);
+		printVerbose(archive, message, archive);
+
+	}
+
+	if ( ( flags & UPDATE ) && ( flags & VERBOSE ) ) {
+
+		char message[128];
+		sprintf(message, "Skipped %u unchanged files (%llu bytes), rewritten %u changed files", x.skippedFiles, x.skippedBytes, x.rewrittenFiles);
+		printVerbose(archive, message, archive);
+
+	}
+
+	if ( x.tar && writeTarEnd(x.stream) == -1 && ! ( flags & QUIET ) )
+		printError(archive, "Cannot write file", x.streamName, errno);
+
+	if ( x.stream == stdout )
+		fflush(stdout);
+	else if ( x.stream && fclose(x.stream) != 0 && ! ( flags & QUIET ) )
+		printError(archive, "Cannot write file", x.streamName, errno);
+
+	nameset_free(&names);
+	free(found.files);
+	free(found.names);
+	freeBlockTable(&table);
+
+#ifdef HAVE_OPENAT
+	if ( x.archiveFd != -1 )
+		close(x.archiveFd);
+#endif
+
+#ifdef HAVE_OPENAT
+	closeDirectories(&x);
+#endif
+#ifdef HAVE_PTHREAD
+	pthread_mutex_destroy(&x.mutex);
+#endif
+
+	SFileCloseArchive(SArchive);
+
+	return x.namesFailed ? -1 : 0;
+
+}
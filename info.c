@@ -19,6 +19,8 @@
 
 #include <StormLib.h>
 
+#include <string.h>
+
 #include "common.h"
 
 static inline unsigned int GetInfo(HANDLE SArchive, SFileInfoClass info) {
@@ -32,12 +34,69 @@ static inline unsigned int GetInfo(HANDLE SArchive, SFileInfoClass info) {
 
 }
 
+/* Print distribution of files by number of sectors */
+static void printSectors(HANDLE SArchive, unsigned int sectorSize) {
+
+	static const unsigned int limits[] = { 1, 4, 16, 64, 256 };
+
+	unsigned int counts[sizeof(limits) / sizeof(limits[0]) + 1];
+	unsigned int singleUnit = 0;
+	unsigned int empty = 0;
+	unsigned int i;
+	SFILE_FIND_DATA data;
+	HANDLE SFind;
+
+	if ( sectorSize == 0 )
+		return;
+
+	memset(counts, 0, sizeof(counts));
+
+	SFind = SFileFindFirstFile(SArchive, "*", &data, NULL);
+
+	if ( ! SFind )
+		return;
+
+	do {
+
+		unsigned int sectors = ( (unsigned long long int)data.dwFileSize + sectorSize - 1 ) / sectorSize;
+
+		if ( data.dwFileSize == 0 ) {
+
+			++empty;
+
+		} else if ( data.dwFileFlags & MPQ_FILE_SINGLE_UNIT ) {
+
+			++singleUnit;
+
+		} else {
+
+			for ( i = 0; i < sizeof(limits) / sizeof(limits[0]) && sectors > limits[i]; ++i );
+			++counts[i];
+
+		}
+
+	} while ( SFileFindNextFile(SFind, &data) );
+
+	SFileFindClose(SFind);
+
+	printMessage("Empty files: %u", empty);
+	printMessage("Single unit files: %u", singleUnit);
+	printMessage("Files with 1 sector: %u", counts[0]);
+
+	for ( i = 1; i < sizeof(limits) / sizeof(limits[0]); ++i )
+		printMessage("Files with %u - %u sectors: %u", limits[i-1] + 1, limits[i], counts[i]);
+
+	printMessage("Files with more than %u sectors: %u", limits[i-1], counts[i]);
+
+}
+
 int smpq_info(const char * archive, unsigned int flags) {
 
 	HANDLE SArchive = NULL;
 
 	unsigned int streamFlags;
 	unsigned int verify;
+	char buffer[256];
 
 	unsigned int SFlags = STREAM_FLAG_READ_ONLY;
 
@@ -62,6 +121,18 @@ int smpq_info(const char * archive, unsigned int flags) {
 	printMessage("Block table size: %u", GetInfo(SArchive, SFileMpqBlockTableSize));
 	printMessage("Sector size: %u", GetInfo(SArchive, SFileMpqSectorSize));
 
+	describeCapacity(buffer, GetInfo(SArchive, SFileMpqNumberOfFiles), GetInfo(SArchive, SFileMpqMaxFileCount), 0);
+	printMessage("Hash table load: %s", buffer);
+
+	if ( hasHetTable(SArchive) ) {
+
+		describeCapacity(buffer, GetInfo(SArchive, SFileMpqNumberOfFiles), GetInfo(SArchive, SFileMpqMaxFileCount), 1);
+		printMessage("HET table load: %s", buffer);
+
+	}
+
+	printSectors(SArchive, GetInfo(SArchive, SFileMpqSectorSize));
+
 	streamFlags = GetInfo(SArchive, SFileMpqStreamFlags);
 
 	if ( streamFlags & STREAM_PROVIDER_PARTIAL )
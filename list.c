@@ -0,0 +1,521 @@
+/*
+    list.c - StormLib MPQ archiving utility
+    Copyright (C) 2010 - 2016  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <StormLib.h>
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "common.h"
+
+/* One listed file, name is offset to names arena of list */
+struct entry {
+
+	size_t name;
+	unsigned int size;
+	unsigned int compressedSize;
+	unsigned int flags;
+	unsigned int locale;
+	unsigned long long int offset;	/* Offset of block in archive or ~0 when it is not known */
+	unsigned long long int time;
+
+};
+
+struct list {
+
+	unsigned int flags;
+	unsigned int format;
+
+	struct blocktable table;
+
+	struct entry * entries;
+	unsigned int count;
+	unsigned int size;
+
+	/* Only names of collected entries, names for duplicate check are in nameset */
+	char * names;
+	size_t namesSize;
+	size_t namesUsed;
+
+};
+
+/* Used by qsort, which does not have argument for comparison function */
+static const char * sortNames;
+static unsigned int sortKey;
+
+/* Read table from archive to new allocated memory, return NULL when archive does not have it */
+static void * readTable(HANDLE SArchive, SFileInfoClass infoClass, unsigned int * size) {
+
+	DWORD needed = 0;
+	void * table;
+
+	SFileGetFileInfo(SArchive, infoClass, NULL, 0, &needed);
+
+	if ( needed == 0 )
+		return NULL;
+
+	table = malloc(needed);
+
+	if ( ! table )
+		return NULL;
+
+	if ( ! SFileGetFileInfo(SArchive, infoClass, table, needed, &needed) ) {
+
+		free(table);
+		return NULL;
+
+	}
+
+	*size = needed;
+	return table;
+
+}
+
+/* Read block table and hi-block table once, so offset of file is known without opening it */
+void readBlockTable(struct blocktable * table, void * SArchive) {
+
+	unsigned int size = 0;
+	unsigned int sizeHi = 0;
+
+	table->blocks = readTable(SArchive, SFileMpqBlockTable, &size);
+	table->blocksHi = NULL;
+	table->count = size / sizeof(TMPQBlock);
+
+	if ( ! table->blocks )
+		return;
+
+	table->blocksHi = (unsigned short *)readTable(SArchive, SFileMpqHiBlockTable, &sizeHi);
+
+	if ( table->blocksHi && sizeHi / sizeof(unsigned short) < table->count ) {
+
+		free(table->blocksHi);
+		table->blocksHi = NULL;
+
+	}
+
+}
+
+unsigned long long int blockOffset(const struct blocktable * table, unsigned int blockIndex) {
+
+	unsigned long long int offset;
+
+	if ( ! table->blocks || blockIndex >= table->count )
+		return ~0ULL;
+
+	offset = ((const TMPQBlock *)table->blocks)[blockIndex].dwFilePos;
+
+	if ( table->blocksHi )
+		offset |= (unsigned long long int)table->blocksHi[blockIndex] << 32;
+
+	return offset;
+
+}
+
+void freeBlockTable(struct blocktable * table) {
+
+	free(table->blocks);
+	free(table->blocksHi);
+
+}
+
+/* Write letters of file flags (same letters as in manifest) */
+static void fileFlags(char * buffer, unsigned int flags) {
+
+	char * c = buffer;
+
+	if ( flags & MPQ_FILE_IMPLODE )
+		*(c++) = 'I';
+	if ( flags & MPQ_FILE_COMPRESS )
+		*(c++) = 'C';
+	if ( flags & MPQ_FILE_ENCRYPTED )
+		*(c++) = 'E';
+	if ( flags & MPQ_FILE_FIX_KEY )
+		*(c++) = 'F';
+	if ( flags & MPQ_FILE_DELETE_MARKER )
+		*(c++) = 'D';
+	if ( flags & MPQ_FILE_SINGLE_UNIT )
+		*(c++) = 'U';
+	if ( flags & MPQ_FILE_SECTOR_CRC )
+		*(c++) = 'S';
+
+	if ( c == buffer )
+		*(c++) = '-';
+
+	*c = 0;
+
+}
+
+static void printEntry(struct list * l, const struct entry * e, const char * SFileName) {
+
+	char fileName[1024];
+	char flags[16];
+	char offset[24];
+	time_t fileTime = 0;
+	unsigned int ratio = e->size ? (unsigned int)( (unsigned long long int)e->compressedSize * 100 / e->size ) : 100;
+
+	fromArchivePath(fileName, SFileName);
+
+	if ( l->format == FORMAT_NUL ) {
+
+		writeBuffered(fileName, strlen(fileName) + 1);
+		return;
+
+	}
+
+	if ( l->format == FORMAT_TEXT && ! ( l->flags & VERBOSE ) ) {
+
+		printBuffered("%12u %s %s\n", e->size, formatFileTime(e->time), fileName);
+		return;
+
+	}
+
+	fileFlags(flags, e->flags);
+
+	if ( l->format == FORMAT_TEXT ) {
+
+		if ( e->offset == ~0ULL )
+			strcpy(offset, "-");
+		else
+			sprintf(offset, "%llx", e->offset);
+
+		printBuffered("%12u %12u %3u%% %-7s %04x %10s %s %s\n", e->size, e->compressedSize, ratio, flags, e->locale, offset, formatFileTime(e->time), fileName);
+		return;
+
+	}
+
+	/* Machine readable formats have exact values, offset and time are empty when they are not known */
+	if ( e->offset == ~0ULL )
+		strcpy(offset, l->format == FORMAT_NDJSON ? "null" : "");
+	else
+		sprintf(offset, "%llu", e->offset);
+
+	if ( l->format == FORMAT_NDJSON ) {
+
+		writeBuffered("{\"name\":", 8);
+		printJsonString(fileName);
+		printBuffered(",\"size\":%u,\"compressed\":%u,\"flags\":\"%s\",\"locale\":%u,\"offset\":%s,\"time\":", e->size, e->compressedSize, flags, e->locale, offset);
+
+		if ( fromFileTime(&fileTime, e->time) )
+			printBuffered("%lld}\n", (long long int)fileTime);
+		else
+			writeBuffered("null}\n", 6);
+
+	} else {
+
+		printCsvString(fileName);
+		printBuffered(",%u,%u,%s,%u,%s,", e->size, e->compressedSize, flags, e->locale, offset);
+
+		if ( fromFileTime(&fileTime, e->time) )
+			printBuffered("%lld\n", (long long int)fileTime);
+		else
+			writeBuffered("\n", 1);
+
+	}
+
+}
+
+/* Store entry for sorting, return -1 on error */
+static int addEntry(struct list * l, const struct entry * e, const char * SFileName) {
+
+	size_t len = strlen(SFileName) + 1;
+
+	if ( l->count == l->size ) {
+
+		unsigned int size = l->size ? l->size * 2 : 1024;
+		struct entry * entries = (struct entry *)realloc(l->entries, size * sizeof(struct entry));
+
+		if ( ! entries )
+			return -1;
+
+		l->entries = entries;
+		l->size = size;
+
+	}
+
+	if ( l->namesUsed + len > l->namesSize ) {
+
+		size_t namesSize = l->namesSize ? l->namesSize * 2 : 0x10000;
+		char * names;
+
+		while ( namesSize < l->namesUsed + len )
+			namesSize *= 2;
+
+		names = (char *)realloc(l->names, namesSize);
+
+		if ( ! names )
+			return -1;
+
+		l->names = names;
+		l->namesSize = namesSize;
+
+	}
+
+	memcpy(l->names + l->namesUsed, SFileName, len);
+	l->entries[l->count] = *e;
+	l->entries[l->count].name = l->namesUsed;
+	l->namesUsed += len;
+	++l->count;
+
+	return 0;
+
+}
+
+/* Ratio of compressed size and size multiplied by size of other file, so ratios are compared without division */
+static int compareRatio(const struct entry * a, const struct entry * b) {
+
+	unsigned long long int ra = (unsigned long long int)a->compressedSize * b->size;
+	unsigned long long int rb = (unsigned long long int)b->compressedSize * a->size;
+
+	if ( ra != rb )
+		return ra < rb ? -1 : 1;
+
+	return 0;
+
+}
+
+/* Names and offsets are sorted ascending, sizes and times descending (biggest and newest first) */
+static int compareEntries(const void * pa, const void * pb) {
+
+	const struct entry * a = (const struct entry *)pa;
+	const struct entry * b = (const struct entry *)pb;
+	int ret = 0;
+
+	switch ( sortKey ) {
+
+		case SORT_SIZE:
+			if ( a->size != b->size )
+				ret = a->size > b->size ? -1 : 1;
+			break;
+
+		case SORT_COMPRESSED:
+			if ( a->compressedSize != b->compressedSize )
+				ret = a->compressedSize > b->compressedSize ? -1 : 1;
+			break;
+
+		case SORT_RATIO:
+			ret = -compareRatio(a, b);
+			break;
+
+		case SORT_OFFSET:
+			if ( a->offset != b->offset )
+				ret = a->offset < b->offset ? -1 : 1;
+			break;
+
+		case SORT_TIME:
+			if ( a->time != b->time )
+				ret = a->time > b->time ? -1 : 1;
+			break;
+
+		default:
+			break;
+
+	}
+
+	if ( ret == 0 )
+		ret = strcmp(sortNames + a->name, sortNames + b->name);
+
+	return ret;
+
+}
+
+int smpq_list(const char * archive, const char * const files[], unsigned int flags, const char * listfile, unsigned int locale, const char * const parchives[], const struct smpq_options * options) {
+
+	int i;
+	HANDLE SArchive = NULL;
+	unsigned int fileCount;
+	struct nameset names;
+	struct list l;
+	int ret = 0;
+
+	unsigned int SFlags = STREAM_FLAG_READ_ONLY;
+
+	if ( flags & NO_LISTFILE )
+		SFlags |= MPQ_OPEN_NO_LISTFILE;
+
+	if ( flags & NO_ATTRIBUTES )
+		SFlags |= MPQ_OPEN_NO_ATTRIBUTES;
+
+	if ( flags & MPQ_VERSION_1 )
+		SFlags |= MPQ_OPEN_FORCE_MPQ_V1;
+
+	if ( flags & MPQ_PARTIAL )
+		SFlags |= STREAM_PROVIDER_PARTIAL;
+
+	if ( flags & MPQ_ENCRYPTED )
+		SFlags |= STREAM_PROVIDER_MPQE;
+
+	memset(&l, 0, sizeof(l));
+
+	/* Verbose messages would be mixed with output for other programs */
+	if ( options->format != FORMAT_TEXT )
+		flags &= ~VERBOSE;
+
+	SArchive = openArchive(archive, flags, SFlags, parchives);
+
+	if ( ! SArchive )
+		return -1;
+
+	if ( ! ( flags & NO_SYSTEM_LF ) )
+		smpq_systemlistfiles(SArchive, archive, flags);
+
+	if ( ! ( flags & NO_LISTFILE ) )
+		SFileAddListFile(SArchive, NULL);
+
+	SFileSetLocale(locale);
+
+	if ( ! SFileGetFileInfo(SArchive, SFileMpqNumberOfFiles, &fileCount, sizeof(fileCount), NULL) )
+		fileCount = 0;
+
+	l.flags = flags;
+	l.format = options->format;
+
+	if ( l.format == FORMAT_CSV )
+		writeBuffered("name,size,compressed,flags,locale,offset,time\n", 46);
+
+	/* Block indexes of files from patched archives are not indexes to block table of base archive */
+	if ( ( flags & VERBOSE ) || options->format == FORMAT_NDJSON || options->format == FORMAT_CSV || options->sort == SORT_OFFSET )
+		if ( ! parchives[0] )
+			readBlockTable(&l.table, SArchive);
+
+	nameset_init(&names, fileCount);
+
+	for ( i = 0; files[i]; ++i ) {
+
+		char mask[512];
+
+		SFILE_FIND_DATA SFileFindData;
+		HANDLE SFileFind = NULL;
+
+		toArchivePath(mask, files[i]);
+
+		SFileFind = SFileFindFirstFile(SArchive, mask, &SFileFindData, listfile);
+
+		/* File which is not in listfile can be still found by its name, only this case needs to open file */
+		if ( ! SFileFind ) {
+
+			HANDLE SFile;
+			unsigned long long int SFileTime = 0;
+
+			if ( ! SFileOpenFileEx(SArchive, mask, SFILE_OPEN_FROM_MPQ, &SFile) ) {
+
+				if ( ! ( flags & QUIET ) )
+					printError(archive, "Cannot open file in archive", mask, GetLastError());
+
+				continue;
+
+			}
+
+			SFileFind = (HANDLE)0xFFFFFFFF;
+			memset(&SFileFindData, 0, sizeof(SFileFindData));
+
+			SFileGetFileName(SFile, SFileFindData.cFileName);
+			SFileFindData.dwFileSize = SFileGetFileSize(SFile, NULL);
+			SFileGetFileInfo(SFile, SFileInfoCompressedSize, &SFileFindData.dwCompSize, sizeof(SFileFindData.dwCompSize), NULL);
+			SFileGetFileInfo(SFile, SFileInfoFlags, &SFileFindData.dwFileFlags, sizeof(SFileFindData.dwFileFlags), NULL);
+			SFileGetFileInfo(SFile, SFileInfoLocale, &SFileFindData.lcLocale, sizeof(SFileFindData.lcLocale), NULL);
+			SFileGetFileInfo(SFile, SFileInfoFileIndex, &SFileFindData.dwBlockIndex, sizeof(SFileFindData.dwBlockIndex), NULL);
+			SFileGetFileInfo(SFile, SFileInfoFileTime, &SFileTime, sizeof(SFileTime), NULL);
+
+			SFileFindData.dwFileTimeLo = (DWORD)SFileTime;
+			SFileFindData.dwFileTimeHi = (DWORD)( SFileTime >> 32 );
+
+			SFileCloseFile(SFile);
+
+		}
+
+		nameset_clear(&names);
+
+		while ( SFileFind ) {
+
+			const char * SFileName = SFileFindData.cFileName;
+			struct entry e;
+
+			if ( strlen(SFileName)+1 > 1024 )
+				goto next;
+
+			if ( strcmp(SFileName, "(listfile)") == 0 || strcmp(SFileName, "(signature)") == 0 || strcmp(SFileName, "(attributes)") == 0 || strstr(SFileName, "(patch_metadata)") != NULL )
+				goto next;
+
+			if ( nameset_add(&names, SFileName, 0) == 0 )
+				goto next;
+
+			e.name = 0;
+			e.size = SFileFindData.dwFileSize;
+			e.compressedSize = SFileFindData.dwCompSize;
+			e.flags = SFileFindData.dwFileFlags;
+			e.locale = SFileFindData.lcLocale;
+			e.offset = blockOffset(&l.table, SFileFindData.dwBlockIndex);
+			e.time = SFileFindData.dwFileTimeLo | ( ((unsigned long long int)SFileFindData.dwFileTimeHi) << 32 );
+
+			if ( options->sort == SORT_NONE ) {
+
+				printEntry(&l, &e, SFileName);
+
+			} else if ( addEntry(&l, &e, SFileName) == -1 ) {
+
+				if ( ! ( flags & QUIET ) )
+					printError(archive, "Cannot list file", SFileName, ENOMEM);
+
+				ret = -1;
+
+			}
+
+next:
+			if ( SFileFind == (HANDLE)0xFFFFFFFF )
+				break;
+
+			if ( ! SFileFindNextFile(SFileFind, &SFileFindData) )
+				break;
+
+		}
+
+		if ( SFileFind != (HANDLE)0xFFFFFFFF )
+			SFileFindClose(SFileFind);
+
+	}
+
+	if ( l.count ) {
+
+		unsigned int j;
+
+		sortNames = l.names;
+		sortKey = options->sort;
+		qsort(l.entries, l.count, sizeof(struct entry), compareEntries);
+
+		for ( j = 0; j < l.count; ++j )
+			printEntry(&l, &l.entries[j], l.names + l.entries[j].name);
+
+	}
+
+	flushBuffered();
+
+	nameset_free(&names);
+
+	free(l.entries);
+	free(l.names);
+	freeBlockTable(&l.table);
+
+	SFileCloseArchive(SArchive);
+
+	return ret;
+
+}
@@ -30,6 +30,10 @@
 #define strcasecmp _stricmp
 #endif
 
+#ifdef _MSC_VER
+#define strtoull _strtoui64
+#endif
+
 #ifdef _MSC_VER
 #define S_ISDIR(x) ((x) & _S_IFDIR)
 #endif
@@ -72,10 +76,30 @@
 	"\n" \
 	"Options for appending file(s) to archive:\n" \
 	"     -m, --max-file-count <count>  Set maximum file count of archive (power of 2, 0 - autodetect) (default: 0)\n" \
+	"     --headroom <percent>          Additional space for files when maximum file count is autodetected (default: 25)\n" \
+	"     --load-factor <percent>       Maximal ratio of files and hash table slots, changed only when crossed, also when removing (default: 75)\n" \
 	"     -E, --encrypt                 Store as encrypted\n" \
 	"     -F, --fix-key                 Encryption key will be adjusted according to file size in the archive (need -E)\n" \
 	"     -D, --deletion-marker         Set deletion marker\n" \
 	"     -U, --single-unit             Add file as single unit, cannot be encrypted\n" \
+	"     --single-unit-threshold <size>  Add files up to this size as single unit, suffix K, M or G (0 - disabled) (default: 0)\n" \
+	"     --sector-size <size>          Sector size of new archive (power of 2 from 512 to 16M) (default: 4K, 16K for version 3 and 4)\n" \
+	"     -j, --jobs <count>            Number of read-ahead threads for appending or threads for extracting files (auto - number of processors) (default: 1)\n" \
+	"          Read-ahead threads only read files (and hash and sample them), compression is still done by one thread\n" \
+	"     --update                      Skip files which are in archive with same size and MD5 (or time), replace changed files\n" \
+	"     --commit-files <count>        Write archive tables after this number of files (0 - only at end) (default: 1)\n" \
+	"     --commit-bytes <size>         Write archive tables after this size of files, suffix K, M or G (0 - only at end) (default: 0)\n" \
+	"          When appending is interrupted, only files appended after the last write of tables are lost\n" \
+	"     --from-manifest <file>        Append files listed in manifest file (- for stdin), one file per line with tab separated fields:\n" \
+	"          local path, name in archive, locale, compression, flags (letters E, F, D, U, S)\n" \
+	"          Empty or missing fields have values of command line options\n" \
+	"     --from-tar <file>             Append files from tar archive (- for stdin) without unpacking, with their names and times\n" \
+	"     --from-zip <file>             Append files from zip archive (- for stdin) without unpacking, with their names and times\n" \
+	"          Zip archive is read by local headers, deflate method needs zlib support\n" \
+	"     --policy <file>               Set compression and flags of files by name, one rule per line with tab separated fields:\n" \
+	"          pattern (glob with * and ?, or .ext), compression, flags (letters E, F, D, U, S or - for none)\n" \
+	"          First matching rule is used, pattern without slash is matched against file name without directory\n" \
+	"     --entropy-check               Store files without compression when entropy of first sectors is too high (see --min-gain)\n" \
 	"     -C, --compression <method>    Compression method: (default: ZLIB)\n" \
 	"          none                   None compression\n" \
 	"          IMPLODE                Pkware Data Compression IMPLODE method - OBSOLETE (It was used only in Diablo I)\n" \
@@ -98,9 +122,35 @@
 	"          SPARSE+ZLIB+PKWARE     Together SPARSE, ZLIB and Pkware Data compression\n" \
 	"          SPARSE+BZIP2+PKWARE    Together SPARSE, BZIP2 and Pkware Data compression\n" \
 	"\n" \
+	"          choose                 Choose the best lossless method for each file by compressing its first sectors\n" \
+	"          choose+ADPCM           Same as choose, but allow lossy ADPCM compression for 16 bit PCM WAVE files\n" \
+	"     --sample-sectors <count>      Number of sectors compressed by method choose (0 - whole file) (default: 16)\n" \
+	"     --decode-weight <bytes>       Bytes of size which method choose pays for one microsecond of estimated decompression (default: 0)\n" \
+	"     --min-gain <percent>          Store file without compression when method choose or entropy check saves less (default: 5)\n" \
+	"\n" \
+	"Options for listing file(s) of archive:\n" \
+	"     -v, --verbose                 Show also compressed size, ratio, flags (letters I, C, E, F, D, U, S), locale and offset of block\n" \
+	"     --sort <key>                  Sort files by key: name, size, compressed, ratio, offset or time (default: order of hash table)\n" \
+	"          Sizes, ratio and time are sorted descending, name and offset ascending\n" \
+	"     --format <format>             Format of list: (default: text)\n" \
+	"          text                   Columns for humans\n" \
+	"          ndjson                 One JSON object per line with name, size, compressed, flags, locale, offset and time\n" \
+	"          csv                    Same fields as comma separated values with header line\n" \
+	"          nul                    Only names terminated by NUL char (for xargs -0)\n" \
+	"\n" \
 	"Options for extracting file(s) from archive:\n" \
 	"     -P, --partial                 Archive is partial (default: autodetect) (Partial archives were used by trial version of World of Warcraft)\n" \
 	"     -X, --not-encrypted           Archive is not encrypted (default: autodetect) (Encrypted archives have Starcraft II installation)\n" \
+	"     --update                      Skip existing files with same size and time as in archive, rewrite changed files (without -f)\n" \
+	"     --checksum                    With --update compare MD5 of existing files with MD5 from archive attributes instead of time\n" \
+	"     --to-stdout                   Write data of files to stdout instead of creating files, messages are written to stderr\n" \
+	"     --framed                      Same as --to-stdout, but each file is record: name length (4 bytes), name, data length (8 bytes), data\n" \
+	"          Lengths are little endian numbers, name has `/' separators\n" \
+	"     --tar <file>                  Write files to POSIX tar archive (- for stdout) instead of creating files\n" \
+	"     --range <offset:length>       Extract only part of each file, decompress only sectors covering it (empty length - to end of file)\n" \
+	"     -T, --files-from <file>       Extract files with exact names from file (one name per line, - for stdin) without listfiles\n" \
+	"          Names are found directly in hash table, missing names are reported together at end\n" \
+	"     --no-io-uring                 Write extracted files by pool of threads even when io_uring is available\n" \
 	"     -p                            Open more (patched) archives with directory prefix (prefix:archive), when file is in more archives, will be extracted from last\n" \
 	"          Usage with more (patched) archives:\n" \
 	"            smpq -l|-x [options] [archive] -p [prefix1:archive1] [prefix2:archive2] ... -- [files]\n" \
@@ -161,6 +211,10 @@ static void parse(char c) {
 			flags |= NO_LISTFILE;
 			break;
 
+		case 'T':
+			skip = NAMES_ARG;
+			break;
+
 		case 'A':
 			flags |= NO_ATTRIBUTES;
 			break;
@@ -215,6 +269,10 @@ static void parse(char c) {
 			flags |= SINGLE_UNIT;
 			break;
 
+		case 'j':
+			skip = JOBS_ARG;
+			break;
+
 		case 'C':
 			flags |= COMPRESSION;
 			skip = COMPRESSION_ARG;
@@ -293,10 +351,82 @@ static void parse(char c) {
 
 }
 
+/* Return argument of option with argument at index arg or exit if it is missing */
+static const char * optionArg(int argc, char * argv[], int arg, const char * name) {
+
+	if ( arg > argc-1 || arg == 0 ) {
+
+		fprintf(stderr, "%s Error: No %s specified\n", app, name);
+		exit(-1);
+
+	}
+
+	return argv[arg];
+
+}
+
+/* Convert decimal number from min to max, exit on invalid number */
+static unsigned int parseNumber(const char * str, const char * name, unsigned int min, unsigned int max) {
+
+	char * end;
+	unsigned long int number;
+
+	errno = 0;
+	number = strtoul(str, &end, 10);
+
+	if ( str[0] < '0' || str[0] > '9' || *end != 0 || errno != 0 || number < min || number > max ) {
+
+		fprintf(stderr, "%s Error: %s must be from %u to %u\n", app, name, min, max);
+		exit(-1);
+
+	}
+
+	return number;
+
+}
+
+/* Convert decimal size with optional suffix K, M or G to bytes, exit on invalid size */
+static unsigned long long int parseSize(const char * str, const char * name) {
+
+	const char * ptr = str;
+	unsigned long long int size = 0;
+	unsigned int shift = 0;
+
+	while ( *ptr >= '0' && *ptr <= '9' ) {
+
+		if ( size > ( ~0ULL - ( *ptr - '0' ) ) / 10 )
+			break;
+
+		size = size * 10 + ( *ptr - '0' );
+		++ptr;
+
+	}
+
+	if ( *ptr == 'K' || *ptr == 'k' )
+		shift = 10;
+	else if ( *ptr == 'M' || *ptr == 'm' )
+		shift = 20;
+	else if ( *ptr == 'G' || *ptr == 'g' )
+		shift = 30;
+
+	if ( shift )
+		++ptr;
+
+	if ( ptr == str || str[0] < '0' || str[0] > '9' || *ptr != 0 || size > ( ~0ULL >> shift ) ) {
+
+		fprintf(stderr, "%s Error: %s must be number with optional suffix K, M or G\n", app, name);
+		exit(-1);
+
+	}
+
+	return size << shift;
+
+}
+
 int main(int argc, char * argv[]) {
 
 	int ret, i, j;
-	int skipArg[10] = { 0 };
+	int skipArg[32] = { 0 };
 
 	unsigned int mpq_version = 4;
 	const char * listfile = NULL;
@@ -305,6 +435,8 @@ int main(int argc, char * argv[]) {
 	const char * compression = "ZLIB";
 	const char * archive;
 
+	struct smpq_options options;
+
 	int parchivesc;
 	const char ** parchives;
 
@@ -313,6 +445,17 @@ int main(int argc, char * argv[]) {
 
 	app = argv[0];
 
+	memset(&options, 0, sizeof(options));
+	options.jobs = 1;
+	options.rangeLength = ~0ULL;
+	options.sampleSectors = 16;
+	options.decodeWeight = 0;
+	options.minGain = 5;
+	options.commitFiles = 1;
+	options.commitBytes = 0;
+	options.headroom = 25;
+	options.loadFactor = 75;
+
 	for ( i = 1; i < argc; ++i ) {
 
 		if ( skip ) {
@@ -378,6 +521,56 @@ int main(int argc, char * argv[]) {
 				parse('U');
 			else if ( strcmp(argv[i], "--compression") == 0 )
 				parse('C');
+			else if ( strcmp(argv[i], "--jobs") == 0 )
+				parse('j');
+			else if ( strcmp(argv[i], "--sample-sectors") == 0 )
+				skip = SAMPLE_SECTORS_ARG;
+			else if ( strcmp(argv[i], "--decode-weight") == 0 )
+				skip = DECODE_WEIGHT_ARG;
+			else if ( strcmp(argv[i], "--min-gain") == 0 )
+				skip = MIN_GAIN_ARG;
+			else if ( strcmp(argv[i], "--commit-files") == 0 )
+				skip = COMMIT_FILES_ARG;
+			else if ( strcmp(argv[i], "--commit-bytes") == 0 )
+				skip = COMMIT_BYTES_ARG;
+			else if ( strcmp(argv[i], "--from-manifest") == 0 )
+				skip = MANIFEST_ARG;
+			else if ( strcmp(argv[i], "--update") == 0 )
+				flags |= UPDATE;
+			else if ( strcmp(argv[i], "--checksum") == 0 )
+				flags |= CHECKSUM;
+			else if ( strcmp(argv[i], "--from-tar") == 0 )
+				skip = FROM_TAR_ARG;
+			else if ( strcmp(argv[i], "--from-zip") == 0 )
+				skip = FROM_ZIP_ARG;
+			else if ( strcmp(argv[i], "--policy") == 0 )
+				skip = POLICY_ARG;
+			else if ( strcmp(argv[i], "--headroom") == 0 )
+				skip = HEADROOM_ARG;
+			else if ( strcmp(argv[i], "--load-factor") == 0 )
+				skip = LOAD_FACTOR_ARG;
+			else if ( strcmp(argv[i], "--sector-size") == 0 )
+				skip = SECTOR_SIZE_ARG;
+			else if ( strcmp(argv[i], "--single-unit-threshold") == 0 )
+				skip = SINGLE_UNIT_ARG;
+			else if ( strcmp(argv[i], "--sort") == 0 )
+				skip = SORT_ARG;
+			else if ( strcmp(argv[i], "--format") == 0 )
+				skip = FORMAT_ARG;
+			else if ( strcmp(argv[i], "--entropy-check") == 0 )
+				flags |= ENTROPY_CHECK;
+			else if ( strcmp(argv[i], "--to-stdout") == 0 )
+				flags |= TO_STDOUT;
+			else if ( strcmp(argv[i], "--framed") == 0 )
+				flags |= TO_STDOUT | FRAMED;
+			else if ( strcmp(argv[i], "--tar") == 0 )
+				skip = TAR_ARG;
+			else if ( strcmp(argv[i], "--range") == 0 )
+				skip = RANGE_ARG;
+			else if ( strcmp(argv[i], "--files-from") == 0 )
+				skip = NAMES_ARG;
+			else if ( strcmp(argv[i], "--no-io-uring") == 0 )
+				flags |= NO_URING;
 			else if ( strcmp(argv[i], "--partial") == 0 )
 				parse('P');
 			else if ( strcmp(argv[i], "--not-encrypted") == 0 )
@@ -507,6 +700,186 @@ int main(int argc, char * argv[]) {
 
 	}
 
+	if ( skipArg[JOBS_ARG] ) {
+
+		if ( skipArg[JOBS_ARG] > argc-1 ) {
+
+			fprintf(stderr, "%s Error: No number of jobs specified\n", app);
+			return -1;
+
+		}
+
+		if ( strcmp(argv[skipArg[JOBS_ARG]], "auto") == 0 ) {
+
+#if defined(WIN32) || defined(_MSC_VER)
+			SYSTEM_INFO info;
+			GetSystemInfo(&info);
+			options.jobs = info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+			long int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+			options.jobs = cpus > 0 ? cpus : 1;
+#else
+			options.jobs = 1;
+#endif
+
+		} else {
+
+			options.jobs = parseNumber(argv[skipArg[JOBS_ARG]], "Number of jobs", 1, 1024);
+
+		}
+
+	}
+
+	if ( skipArg[SAMPLE_SECTORS_ARG] )
+		options.sampleSectors = parseNumber(optionArg(argc, argv, skipArg[SAMPLE_SECTORS_ARG], "number of sample sectors"), "Number of sample sectors", 0, 65536);
+
+	if ( skipArg[DECODE_WEIGHT_ARG] )
+		options.decodeWeight = parseNumber(optionArg(argc, argv, skipArg[DECODE_WEIGHT_ARG], "decode weight"), "Decode weight", 0, 1000000);
+
+	if ( skipArg[MIN_GAIN_ARG] )
+		options.minGain = parseNumber(optionArg(argc, argv, skipArg[MIN_GAIN_ARG], "minimal gain"), "Minimal gain", 0, 100);
+
+	if ( skipArg[COMMIT_FILES_ARG] )
+		options.commitFiles = parseNumber(optionArg(argc, argv, skipArg[COMMIT_FILES_ARG], "number of files for commit"), "Number of files for commit", 0, 0xFFFFFFFF);
+
+	if ( skipArg[COMMIT_BYTES_ARG] ) {
+
+		options.commitBytes = parseSize(optionArg(argc, argv, skipArg[COMMIT_BYTES_ARG], "size for commit"), "Size for commit");
+
+		if ( ! skipArg[COMMIT_FILES_ARG] )
+			options.commitFiles = 0;
+
+	}
+
+	if ( skipArg[MANIFEST_ARG] )
+		options.manifest = optionArg(argc, argv, skipArg[MANIFEST_ARG], "manifest");
+
+	if ( skipArg[FROM_TAR_ARG] )
+		options.fromTar = optionArg(argc, argv, skipArg[FROM_TAR_ARG], "tar archive");
+
+	if ( skipArg[FROM_ZIP_ARG] )
+		options.fromZip = optionArg(argc, argv, skipArg[FROM_ZIP_ARG], "zip archive");
+
+	if ( options.fromTar && options.fromZip ) {
+
+		fprintf(stderr, "%s Error: Only one of tar and zip archive can be specified\n", app);
+		return -1;
+
+	}
+
+	if ( skipArg[POLICY_ARG] )
+		options.policy = optionArg(argc, argv, skipArg[POLICY_ARG], "policy");
+
+	if ( skipArg[HEADROOM_ARG] )
+		options.headroom = parseNumber(optionArg(argc, argv, skipArg[HEADROOM_ARG], "headroom"), "Headroom", 0, 1000);
+
+	if ( skipArg[SECTOR_SIZE_ARG] ) {
+
+		unsigned long long int sectorSize = parseSize(optionArg(argc, argv, skipArg[SECTOR_SIZE_ARG], "sector size"), "Sector size");
+
+		if ( sectorSize < 0x200 || sectorSize > 0x1000000 || ( sectorSize & ( sectorSize - 1 ) ) != 0 ) {
+
+			fprintf(stderr, "%s Error: Sector size must be power of 2 from 512 to 16M\n", app);
+			return -1;
+
+		}
+
+		options.sectorSize = sectorSize;
+
+	}
+
+	if ( skipArg[SINGLE_UNIT_ARG] )
+		options.singleUnitThreshold = parseSize(optionArg(argc, argv, skipArg[SINGLE_UNIT_ARG], "single unit threshold"), "Single unit threshold");
+
+	if ( skipArg[SORT_ARG] ) {
+
+		const char * sort = optionArg(argc, argv, skipArg[SORT_ARG], "sort key");
+
+		if ( strcmp(sort, "name") == 0 )
+			options.sort = SORT_NAME;
+		else if ( strcmp(sort, "size") == 0 )
+			options.sort = SORT_SIZE;
+		else if ( strcmp(sort, "compressed") == 0 )
+			options.sort = SORT_COMPRESSED;
+		else if ( strcmp(sort, "ratio") == 0 )
+			options.sort = SORT_RATIO;
+		else if ( strcmp(sort, "offset") == 0 )
+			options.sort = SORT_OFFSET;
+		else if ( strcmp(sort, "time") == 0 )
+			options.sort = SORT_TIME;
+		else {
+
+			fprintf(stderr, "%s Error: Unknown sort key `%s'\n", app, sort);
+			return -1;
+
+		}
+
+	}
+
+	if ( skipArg[FORMAT_ARG] ) {
+
+		const char * format = optionArg(argc, argv, skipArg[FORMAT_ARG], "list format");
+
+		if ( strcmp(format, "text") == 0 )
+			options.format = FORMAT_TEXT;
+		else if ( strcmp(format, "ndjson") == 0 )
+			options.format = FORMAT_NDJSON;
+		else if ( strcmp(format, "csv") == 0 )
+			options.format = FORMAT_CSV;
+		else if ( strcmp(format, "nul") == 0 )
+			options.format = FORMAT_NUL;
+		else {
+
+			fprintf(stderr, "%s Error: Unknown list format `%s'\n", app, format);
+			return -1;
+
+		}
+
+	}
+
+	if ( skipArg[LOAD_FACTOR_ARG] )
+		options.loadFactor = parseNumber(optionArg(argc, argv, skipArg[LOAD_FACTOR_ARG], "load factor"), "Load factor", 1, 100);
+
+	if ( skipArg[TAR_ARG] )
+		options.tar = optionArg(argc, argv, skipArg[TAR_ARG], "tar archive");
+
+	if ( skipArg[RANGE_ARG] ) {
+
+		const char * range = optionArg(argc, argv, skipArg[RANGE_ARG], "range");
+		const char * length = strchr(range, ':');
+		char offset[32];
+
+		if ( ! length || (size_t)( length - range ) >= sizeof(offset) ) {
+
+			fprintf(stderr, "%s Error: Range must be offset:length\n", app);
+			return -1;
+
+		}
+
+		memcpy(offset, range, length - range);
+		offset[length - range] = 0;
+
+		options.rangeOffset = parseSize(offset, "Range offset");
+		options.rangeLength = length[1] ? parseSize(length + 1, "Range length") : ~0ULL;
+
+	}
+
+	if ( skipArg[NAMES_ARG] ) {
+
+		options.names = optionArg(argc, argv, skipArg[NAMES_ARG], "names file");
+
+		if ( action != 'x' || ( flags & LIST ) ) {
+
+			fprintf(stderr, "%s Error: Names file can be used only for extracting files\n", app);
+			return -1;
+
+		}
+
+	}
+
+	if ( ( flags & TO_STDOUT ) || ( options.tar && strcmp(options.tar, "-") == 0 ) )
+		redirectMessages();
+
 	archive = argv[i++];
 
 	if ( ! ( flags & MPQ_NOT_ENCRYPTED ) && strlen(archive) > 5 && strcasecmp(archive+strlen(archive)-5, ".mpqe") == 0 )
@@ -577,14 +950,15 @@ int main(int argc, char * argv[]) {
 
 	if ( action == 'x' ) {
 
-		if ( filesc == 0 ) {
+		/* Only names from names file are extracted when no masks are specified */
+		if ( filesc == 0 && ! options.names ) {
 
 			filesc = 1;
 			files[0] = "*";
 
 		}
 
-	} else if ( action != 'a' || ! ( flags & CREATE ) ) {
+	} else if ( action != 'a' || ! ( ( flags & CREATE ) || options.manifest || options.fromTar || options.fromZip ) ) {
 
 		if ( filesc == 0 ) {
 
@@ -602,15 +976,18 @@ int main(int argc, char * argv[]) {
 	switch ( action ) {
 
 		case 'a':
-			ret = smpq_append(archive, files, flags, locale, maxFileCount, compression);
+			ret = smpq_append(archive, files, flags, locale, maxFileCount, compression, &options);
 			break;
 
 		case 'x':
-			ret = smpq_extract(archive, files, flags, listfile, locale, parchives);
+			if ( flags & LIST )
+				ret = smpq_list(archive, files, flags, listfile, locale, parchives, &options);
+			else
+				ret = smpq_extract(archive, files, flags, listfile, locale, parchives, &options);
 			break;
 
 		case 'r':
-			ret = smpq_remove(archive, files, flags, listfile, locale);
+			ret = smpq_remove(archive, files, flags, listfile, locale, &options);
 			break;
 
 		default:
@@ -23,11 +23,13 @@
 
 char StormLibCopyright[] = { 0 };
 const char * app = "smpq";
-int smpq_append(const char * archive, const char * const files[], unsigned int flags, unsigned int locale, unsigned int maxFileCount, const char * compression) { (void)archive; (void)files; (void)flags; (void)locale; (void)maxFileCount; (void)compression; return 0; }
-int smpq_extract(const char * archive, const char * const files[], unsigned int flags, const char * listfile, unsigned int locale, const char * const parchives[]) { (void)archive; (void)files; (void)flags; (void)listfile; (void)locale; (void)parchives; return 0; }
+int smpq_append(const char * archive, const char * const files[], unsigned int flags, unsigned int locale, unsigned int maxFileCount, const char * compression, const struct smpq_options * options) { (void)archive; (void)files; (void)flags; (void)locale; (void)maxFileCount; (void)compression; (void)options; return 0; }
+int smpq_extract(const char * archive, const char * const files[], unsigned int flags, const char * listfile, unsigned int locale, const char * const parchives[], const struct smpq_options * options) { (void)archive; (void)files; (void)flags; (void)listfile; (void)locale; (void)parchives; (void)options; return 0; }
+int smpq_list(const char * archive, const char * const files[], unsigned int flags, const char * listfile, unsigned int locale, const char * const parchives[], const struct smpq_options * options) { (void)archive; (void)files; (void)flags; (void)listfile; (void)locale; (void)parchives; (void)options; return 0; }
 int smpq_info(const char * archive, unsigned int flags) { (void)archive; (void)flags; return 0; }
-int smpq_remove(const char * archive, const char * const files[], unsigned int flags, const char * listfile, unsigned int locale) { (void)archive; (void)files; (void)flags; (void)listfile; (void)locale; return 0; }
+int smpq_remove(const char * archive, const char * const files[], unsigned int flags, const char * listfile, unsigned int locale, const struct smpq_options * options) { (void)archive; (void)files; (void)flags; (void)listfile; (void)locale; (void)options; return 0; }
 int smpq_rename(const char * archive, const char * oldName, const char * newName, unsigned int flags, const char * listfile, unsigned int locale) { (void)archive; (void)oldName; (void)newName; (void)newName; (void)flags; (void)listfile; (void)locale; return 0; }
+void redirectMessages(void) { }
 
 #include <stdio.h>
 #include <string.h>
@@ -0,0 +1,190 @@
+/*
+    md5.c - StormLib MPQ archiving utility
+    Copyright (C) 2010 - 2016  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* MD5 message digest algorithm as described in RFC 1321 */
+
+#include <string.h>
+
+#include "common.h"
+
+#define F(x, y, z) ( (z) ^ ( (x) & ( (y) ^ (z) ) ) )
+#define G(x, y, z) ( (y) ^ ( (z) & ( (x) ^ (y) ) ) )
+#define H(x, y, z) ( (x) ^ (y) ^ (z) )
+#define I(x, y, z) ( (y) ^ ( (x) | ~(z) ) )
+
+#define STEP(f, a, b, c, d, x, t, s) do { \
+	(a) += f((b), (c), (d)) + (x) + (t); \
+	(a) = ( ( (a) << (s) ) | ( ( (a) & 0xFFFFFFFF ) >> ( 32 - (s) ) ) ) & 0xFFFFFFFF; \
+	(a) += (b); \
+} while (0)
+
+static void md5Block(unsigned int state[4], const unsigned char * data) {
+
+	unsigned int x[16];
+	unsigned int a = state[0];
+	unsigned int b = state[1];
+	unsigned int c = state[2];
+	unsigned int d = state[3];
+	int i;
+
+	for ( i = 0; i < 16; ++i )
+		x[i] = data[i*4] | ( data[i*4+1] << 8 ) | ( data[i*4+2] << 16 ) | ( (unsigned int)data[i*4+3] << 24 );
+
+	STEP(F, a, b, c, d, x[0], 0xd76aa478, 7);
+	STEP(F, d, a, b, c, x[1], 0xe8c7b756, 12);
+	STEP(F, c, d, a, b, x[2], 0x242070db, 17);
+	STEP(F, b, c, d, a, x[3], 0xc1bdceee, 22);
+	STEP(F, a, b, c, d, x[4], 0xf57c0faf, 7);
+	STEP(F, d, a, b, c, x[5], 0x4787c62a, 12);
+	STEP(F, c, d, a, b, x[6], 0xa8304613, 17);
+	STEP(F, b, c, d, a, x[7], 0xfd469501, 22);
+	STEP(F, a, b, c, d, x[8], 0x698098d8, 7);
+	STEP(F, d, a, b, c, x[9], 0x8b44f7af, 12);
+	STEP(F, c, d, a, b, x[10], 0xffff5bb1, 17);
+	STEP(F, b, c, d, a, x[11], 0x895cd7be, 22);
+	STEP(F, a, b, c, d, x[12], 0x6b901122, 7);
+	STEP(F, d, a, b, c, x[13], 0xfd987193, 12);
+	STEP(F, c, d, a, b, x[14], 0xa679438e, 17);
+	STEP(F, b, c, d, a, x[15], 0x49b40821, 22);
+
+	STEP(G, a, b, c, d, x[1], 0xf61e2562, 5);
+	STEP(G, d, a, b, c, x[6], 0xc040b340, 9);
+	STEP(G, c, d, a, b, x[11], 0x265e5a51, 14);
+	STEP(G, b, c, d, a, x[0], 0xe9b6c7aa, 20);
+	STEP(G, a, b, c, d, x[5], 0xd62f105d, 5);
+	STEP(G, d, a, b, c, x[10], 0x02441453, 9);
+	STEP(G, c, d, a, b, x[15], 0xd8a1e681, 14);
+	STEP(G, b, c, d, a, x[4], 0xe7d3fbc8, 20);
+	STEP(G, a, b, c, d, x[9], 0x21e1cde6, 5);
+	STEP(G, d, a, b, c, x[14], 0xc33707d6, 9);
+	STEP(G, c, d, a, b, x[3], 0xf4d50d87, 14);
+	STEP(G, b, c, d, a, x[8], 0x455a14ed, 20);
+	STEP(G, a, b, c, d, x[13], 0xa9e3e905, 5);
+	STEP(G, d, a, b, c, x[2], 0xfcefa3f8, 9);
+	STEP(G, c, d, a, b, x[7], 0x676f02d9, 14);
+	STEP(G, b, c, d, a, x[12], 0x8d2a4c8a, 20);
+
+	STEP(H, a, b, c, d, x[5], 0xfffa3942, 4);
+	STEP(H, d, a, b, c, x[8], 0x8771f681, 11);
+	STEP(H, c, d, a, b, x[11], 0x6d9d6122, 16);
+	STEP(H, b, c, d, a, x[14], 0xfde5380c, 23);
+	STEP(H, a, b, c, d, x[1], 0xa4beea44, 4);
+	STEP(H, d, a, b, c, x[4], 0x4bdecfa9, 11);
+	STEP(H, c, d, a, b, x[7], 0xf6bb4b60, 16);
+	STEP(H, b, c, d, a, x[10], 0xbebfbc70, 23);
+	STEP(H, a, b, c, d, x[13], 0x289b7ec6, 4);
+	STEP(H, d, a, b, c, x[0], 0xeaa127fa, 11);
+	STEP(H, c, d, a, b, x[3], 0xd4ef3085, 16);
+	STEP(H, b, c, d, a, x[6], 0x04881d05, 23);
+	STEP(H, a, b, c, d, x[9], 0xd9d4d039, 4);
+	STEP(H, d, a, b, c, x[12], 0xe6db99e5, 11);
+	STEP(H, c, d, a, b, x[15], 0x1fa27cf8, 16);
+	STEP(H, b, c, d, a, x[2], 0xc4ac5665, 23);
+
+	STEP(I, a, b, c, d, x[0], 0xf4292244, 6);
+	STEP(I, d, a, b, c, x[7], 0x432aff97, 10);
+	STEP(I, c, d, a, b, x[14], 0xab9423a7, 15);
+	STEP(I, b, c, d, a, x[5], 0xfc93a039, 21);
+	STEP(I, a, b, c, d, x[12], 0x655b59c3, 6);
+	STEP(I, d, a, b, c, x[3], 0x8f0ccc92, 10);
+	STEP(I, c, d, a, b, x[10], 0xffeff47d, 15);
+	STEP(I, b, c, d, a, x[1], 0x85845dd1, 21);
+	STEP(I, a, b, c, d, x[8], 0x6fa87e4f, 6);
+	STEP(I, d, a, b, c, x[15], 0xfe2ce6e0, 10);
+	STEP(I, c, d, a, b, x[6], 0xa3014314, 15);
+	STEP(I, b, c, d, a, x[13], 0x4e0811a1, 21);
+	STEP(I, a, b, c, d, x[4], 0xf7537e82, 6);
+	STEP(I, d, a, b, c, x[11], 0xbd3af235, 10);
+	STEP(I, c, d, a, b, x[2], 0x2ad7d2bb, 15);
+	STEP(I, b, c, d, a, x[9], 0xeb86d391, 21);
+
+	state[0] = ( state[0] + a ) & 0xFFFFFFFF;
+	state[1] = ( state[1] + b ) & 0xFFFFFFFF;
+	state[2] = ( state[2] + c ) & 0xFFFFFFFF;
+	state[3] = ( state[3] + d ) & 0xFFFFFFFF;
+
+}
+
+void md5Init(struct md5 * ctx) {
+
+	ctx->state[0] = 0x67452301;
+	ctx->state[1] = 0xefcdab89;
+	ctx->state[2] = 0x98badcfe;
+	ctx->state[3] = 0x10325476;
+	ctx->count = 0;
+
+}
+
+void md5Update(struct md5 * ctx, const void * data, size_t size) {
+
+	const unsigned char * ptr = (const unsigned char *)data;
+	size_t used = ctx->count % 64;
+
+	ctx->count += size;
+
+	if ( used ) {
+
+		size_t free = 64 - used;
+
+		if ( size < free ) {
+
+			memcpy(ctx->buffer + used, ptr, size);
+			return;
+
+		}
+
+		memcpy(ctx->buffer + used, ptr, free);
+		md5Block(ctx->state, ctx->buffer);
+		ptr += free;
+		size -= free;
+
+	}
+
+	while ( size >= 64 ) {
+
+		md5Block(ctx->state, ptr);
+		ptr += 64;
+		size -= 64;
+
+	}
+
+	memcpy(ctx->buffer, ptr, size);
+
+}
+
+void md5Final(struct md5 * ctx, unsigned char digest[16]) {
+
+	unsigned char padding[72];
+	unsigned long long int bits = ctx->count * 8;
+	size_t used = ctx->count % 64;
+	size_t size = ( used < 56 ) ? 56 - used : 120 - used;
+	int i;
+
+	memset(padding, 0, sizeof(padding));
+	padding[0] = 0x80;
+
+	for ( i = 0; i < 8; ++i )
+		padding[size + i] = ( bits >> ( i * 8 ) ) & 0xFF;
+
+	md5Update(ctx, padding, size + 8);
+
+	for ( i = 0; i < 16; ++i )
+		digest[i] = ( ctx->state[i / 4] >> ( ( i % 4 ) * 8 ) ) & 0xFF;
+
+}
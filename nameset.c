@@ -0,0 +1,172 @@
+/*
+    nameset.c - StormLib MPQ archiving utility
+    Copyright (C) 2010 - 2016  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+/* FNV-1a hash of name */
+static unsigned int nameset_hash(const char * str) {
+
+	unsigned int hash = 2166136261U;
+
+	while ( *str ) {
+
+		hash ^= (unsigned char)*(str++);
+		hash *= 16777619U;
+
+	}
+
+	return hash;
+
+}
+
+/* Initialize empty set for expected number of names */
+void nameset_init(struct nameset * set, unsigned int expected) {
+
+	set->size = 64;
+
+	while ( set->size < expected * 2 && set->size < 0x40000000 )
+		set->size *= 2;
+
+	set->slots = NULL;
+	set->count = 0;
+	set->arena = NULL;
+	set->arenaSize = 0;
+	set->arenaUsed = 0;
+
+}
+
+/* Remove all names, memory is kept for next use */
+void nameset_clear(struct nameset * set) {
+
+	if ( set->slots )
+		memset(set->slots, 0, set->size * sizeof(struct nameslot));
+
+	set->count = 0;
+	set->arenaUsed = 0;
+
+}
+
+void nameset_free(struct nameset * set) {
+
+	free(set->slots);
+	free(set->arena);
+
+}
+
+/* Double size of table, names in arena are not moved */
+static int nameset_grow(struct nameset * set) {
+
+	struct nameslot * slots = (struct nameslot *)calloc(set->size * 2, sizeof(struct nameslot));
+	unsigned int i;
+
+	if ( ! slots )
+		return -1;
+
+	for ( i = 0; i < set->size; ++i ) {
+
+		unsigned int j;
+
+		if ( ! set->slots[i].name )
+			continue;
+
+		for ( j = set->slots[i].hash & ( set->size * 2 - 1 ); slots[j].name; j = ( j + 1 ) & ( set->size * 2 - 1 ) );
+
+		slots[j] = set->slots[i];
+
+	}
+
+	free(set->slots);
+	set->slots = slots;
+	set->size *= 2;
+
+	return 0;
+
+}
+
+/* Find name in set, return its slot (valid until next add) or NULL */
+const struct nameslot * nameset_get(const struct nameset * set, const char * str) {
+
+	unsigned int hash = nameset_hash(str);
+	unsigned int i;
+
+	if ( ! set->slots )
+		return NULL;
+
+	for ( i = hash & ( set->size - 1 ); set->slots[i].name; i = ( i + 1 ) & ( set->size - 1 ) )
+		if ( set->slots[i].hash == hash && strcmp(set->arena + set->slots[i].name - 1, str) == 0 )
+			return &set->slots[i];
+
+	return NULL;
+
+}
+
+/* Add name with value to set, return 0 if it was already in set, 1 if it was added and -1 on error */
+int nameset_add(struct nameset * set, const char * str, int value) {
+
+	unsigned int hash = nameset_hash(str);
+	size_t len = strlen(str) + 1;
+	unsigned int i;
+
+	if ( ! set->slots ) {
+
+		set->slots = (struct nameslot *)calloc(set->size, sizeof(struct nameslot));
+
+		if ( ! set->slots )
+			return -1;
+
+	}
+
+	for ( i = hash & ( set->size - 1 ); set->slots[i].name; i = ( i + 1 ) & ( set->size - 1 ) )
+		if ( set->slots[i].hash == hash && strcmp(set->arena + set->slots[i].name - 1, str) == 0 )
+			return 0;
+
+	if ( set->arenaUsed + len > set->arenaSize ) {
+
+		size_t arenaSize = set->arenaSize ? set->arenaSize * 2 : 0x10000;
+		char * arena;
+
+		while ( arenaSize < set->arenaUsed + len )
+			arenaSize *= 2;
+
+		arena = (char *)realloc(set->arena, arenaSize);
+
+		if ( ! arena )
+			return -1;
+
+		set->arena = arena;
+		set->arenaSize = arenaSize;
+
+	}
+
+	memcpy(set->arena + set->arenaUsed, str, len);
+	set->slots[i].hash = hash;
+	set->slots[i].name = set->arenaUsed + 1;
+	set->slots[i].value = value;
+	set->arenaUsed += len;
+
+	/* Table is at most half full, so probe sequences stay short */
+	if ( ++set->count * 2 > set->size )
+		nameset_grow(set);
+
+	return 1;
+
+}
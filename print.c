@@ -45,21 +45,194 @@ void printError(const char * archive, const char * message, const char * file, i
 
 }
 
+/* Set to nonzero when stdout has data of extracted files */
+static int messagesToStderr;
+
+void redirectMessages(void) {
+
+	messagesToStderr = 1;
+
+}
+
 void printVerbose(const char * archive, const char * message, const char * file) {
 
-	printf("%s: %s: %s `%s' ...\n", app, archive, message, file);
-	fflush(stdout);
+	FILE * stream = messagesToStderr ? stderr : stdout;
+
+	fprintf(stream, "%s: %s: %s `%s' ...\n", app, archive, message, file);
+	fflush(stream);
 
 }
 
 void printMessage(const char * message, ...) {
 
+	FILE * stream = messagesToStderr ? stderr : stdout;
 	va_list ap;
 
 	va_start(ap, message);
-	vprintf(message, ap);
+	vfprintf(stream, message, ap);
 	va_end(ap);
-	putchar('\n');
+	fputc('\n', stream);
+	fflush(stream);
+
+}
+
+/* Buffer of standard output for long listings, written in big blocks instead of flush after each line */
+#define OUTPUT_BUFFER 0x10000
+
+static char outputBuffer[OUTPUT_BUFFER];
+static size_t outputUsed;
+
+void flushBuffered(void) {
+
+	if ( outputUsed )
+		fwrite(outputBuffer, 1, outputUsed, stdout);
+
+	outputUsed = 0;
 	fflush(stdout);
 
 }
+
+void writeBuffered(const char * data, size_t size) {
+
+	if ( outputUsed + size > OUTPUT_BUFFER ) {
+
+		fwrite(outputBuffer, 1, outputUsed, stdout);
+		outputUsed = 0;
+
+	}
+
+	if ( size > OUTPUT_BUFFER ) {
+
+		fwrite(data, 1, size, stdout);
+		return;
+
+	}
+
+	memcpy(outputBuffer + outputUsed, data, size);
+	outputUsed += size;
+
+}
+
+/* Message which does not fit to rest of buffer is formatted again after flush, message longer than buffer is written directly */
+void printBuffered(const char * message, ...) {
+
+	va_list ap;
+	int size;
+
+	va_start(ap, message);
+	size = vsnprintf(outputBuffer + outputUsed, OUTPUT_BUFFER - outputUsed, message, ap);
+	va_end(ap);
+
+	if ( size < 0 )
+		return;
+
+	if ( (size_t)size < OUTPUT_BUFFER - outputUsed ) {
+
+		outputUsed += size;
+		return;
+
+	}
+
+	fwrite(outputBuffer, 1, outputUsed, stdout);
+	outputUsed = 0;
+
+	va_start(ap, message);
+
+	if ( size < OUTPUT_BUFFER )
+		outputUsed = vsnprintf(outputBuffer, OUTPUT_BUFFER, message, ap);
+	else
+		vfprintf(stdout, message, ap);
+
+	va_end(ap);
+
+}
+
+/* Control chars are escaped as \uXXXX, other bytes are written as they are (names in archive should be UTF-8) */
+void printJsonString(const char * str) {
+
+	const char * start = str;
+
+	writeBuffered("\"", 1);
+
+	for ( ; *str; ++str ) {
+
+		unsigned char c = *str;
+
+		if ( c >= 0x20 && c != '"' && c != '\\' )
+			continue;
+
+		writeBuffered(start, str - start);
+		start = str + 1;
+
+		if ( c == '"' )
+			writeBuffered("\\\"", 2);
+		else if ( c == '\\' )
+			writeBuffered("\\\\", 2);
+		else
+			printBuffered("\\u%04x", c);
+
+	}
+
+	writeBuffered(start, str - start);
+	writeBuffered("\"", 1);
+
+}
+
+/* Field is quoted only when it contains separator, quote or new line (RFC 4180) */
+void printCsvString(const char * str) {
+
+	const char * start = str;
+
+	if ( ! strpbrk(str, ",\"\r\n") ) {
+
+		writeBuffered(str, strlen(str));
+		return;
+
+	}
+
+	writeBuffered("\"", 1);
+
+	for ( ; *str; ++str ) {
+
+		if ( *str != '"' )
+			continue;
+
+		writeBuffered(start, str - start + 1);
+		start = str;
+
+	}
+
+	writeBuffered(start, str - start);
+	writeBuffered("\"", 1);
+
+}
+
+/* Files in archive have usually only few distinct times, so formatted times are cached */
+#define TIME_CACHE 64
+
+static struct {
+
+	int used;
+	unsigned long long int fileTime;
+	char text[32];
+
+} timeCache[TIME_CACHE];
+
+const char * formatFileTime(unsigned long long int SFileTime) {
+
+	unsigned int i = (unsigned int)( SFileTime ^ ( SFileTime >> 32 ) ) % TIME_CACHE;
+	time_t fileTime = 0;
+
+	if ( timeCache[i].used && timeCache[i].fileTime == SFileTime )
+		return timeCache[i].text;
+
+	if ( ! fromFileTime(&fileTime, SFileTime) )
+		fileTime = 0;
+
+	strftime(timeCache[i].text, sizeof(timeCache[i].text), "%Y-%m-%d %H:%M", localtime(&fileTime));
+	timeCache[i].used = 1;
+	timeCache[i].fileTime = SFileTime;
+
+	return timeCache[i].text;
+
+}
@@ -21,7 +21,7 @@
 
 #include "common.h"
 
-int smpq_remove(const char * archive, const char * const files[], unsigned int flags, const char * listfile, unsigned int locale) {
+int smpq_remove(const char * archive, const char * const files[], unsigned int flags, const char * listfile, unsigned int locale, const struct smpq_options * options) {
 
 	int i;
 	int needCompact = 0;
@@ -93,22 +93,25 @@ int smpq_remove(const char * archive, const char * const files[], unsigned int f
 
 		unsigned int fileCount;
 		unsigned int maxFileCount;
+		unsigned int newMaxFileCount = 0;
+		int het = hasHetTable(SArchive);
 
-		if ( ! SFileGetFileInfo(SArchive, SFileMpqNumberOfFiles, &fileCount, sizeof(fileCount), 0) )
-			fileCount = 6;
+		if ( SFileGetFileInfo(SArchive, SFileMpqNumberOfFiles, &fileCount, sizeof(fileCount), 0) && SFileGetFileInfo(SArchive, SFileMpqMaxFileCount, &maxFileCount, sizeof(maxFileCount), 0) ) {
 
-		if ( ! SFileGetFileInfo(SArchive, SFileMpqMaxFileCount, &maxFileCount, sizeof(maxFileCount), 0) )
-			maxFileCount = 6;
+			/* Removing files never grows hash table */
+			newMaxFileCount = resizeCapacity(fileCount, maxFileCount, het, options);
 
-		if ( fileCount < 6 )
-			fileCount = 6;
+			if ( newMaxFileCount >= maxFileCount )
+				newMaxFileCount = 0;
 
-		if ( fileCount * 2 <= maxFileCount ) {
+		}
+
+		if ( newMaxFileCount != 0 ) {
 
 			if ( flags & VERBOSE )
 				printVerbose(archive, "Change maximum file count", archive);
 
-			if ( ! SFileSetMaxFileCount(SArchive, fileCount) )
+			if ( ! SFileSetMaxFileCount(SArchive, newMaxFileCount) )
 				if ( ! ( flags & QUIET ) )
 					printError(archive, "Cannot change maximum file count", archive, GetLastError());
 
@@ -123,6 +126,14 @@ int smpq_remove(const char * archive, const char * const files[], unsigned int f
 
 		SFileFlushArchive(SArchive);
 
+		if ( ( flags & VERBOSE ) && SFileGetFileInfo(SArchive, SFileMpqNumberOfFiles, &fileCount, sizeof(fileCount), 0) && SFileGetFileInfo(SArchive, SFileMpqMaxFileCount, &maxFileCount, sizeof(maxFileCount), 0) ) {
+
+			char message[256];
+			describeCapacity(message, fileCount, maxFileCount, het);
+			printVerbose(archive, message, archive);
+
+		}
+
 	}
 
 	SFileCloseArchive(SArchive);
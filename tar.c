@@ -0,0 +1,165 @@
+/*
+    tar.c - StormLib MPQ archiving utility
+    Copyright (C) 2010 - 2016  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* Writing of POSIX tar archives (ustar format with pax extended headers for long names) */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+
+#define TAR_BLOCK 512
+
+/* Write number as octal digits terminated by NUL */
+static void tarNumber(char * field, size_t size, unsigned long long int value) {
+
+	size_t i;
+
+	field[size - 1] = 0;
+
+	for ( i = size - 1; i > 0; --i ) {
+
+		field[i - 1] = '0' + ( value & 7 );
+		value >>= 3;
+
+	}
+
+}
+
+/* Write one header block, name and prefix must fit to their fields */
+static int tarBlock(FILE * file, const char * name, const char * prefix, char type, unsigned long long int size, time_t mtime) {
+
+	char block[TAR_BLOCK];
+	unsigned int checksum = 0;
+	int i;
+
+	memset(block, 0, sizeof(block));
+
+	strncpy(block, name, 100);
+	tarNumber(block + 100, 8, 0644);
+	tarNumber(block + 108, 8, 0);
+	tarNumber(block + 116, 8, 0);
+	tarNumber(block + 124, 12, size);
+	tarNumber(block + 136, 12, mtime > 0 ? (unsigned long long int)mtime : 0);
+	block[156] = type;
+	memcpy(block + 257, "ustar", 6);
+	memcpy(block + 263, "00", 2);
+	strncpy(block + 345, prefix, 155);
+
+	/* Checksum is computed with spaces in checksum field */
+	memset(block + 148, ' ', 8);
+
+	for ( i = 0; i < TAR_BLOCK; ++i )
+		checksum += (unsigned char)block[i];
+
+	tarNumber(block + 148, 7, checksum);
+
+	if ( fwrite(block, 1, TAR_BLOCK, file) != TAR_BLOCK )
+		return -1;
+
+	return 0;
+
+}
+
+/* Write pax extended header with path, record length includes its own decimal digits */
+static int tarPaxPath(FILE * file, const char * name, time_t mtime) {
+
+	char paxName[100];
+	size_t len = strlen(" path=\n") + strlen(name);
+	size_t total = len + 1;
+	char digits[24];
+
+	while ( (size_t)sprintf(digits, "%lu", (unsigned long int)total) + len != total )
+		total = len + strlen(digits);
+
+	strcpy(paxName, "PaxHeaders/");
+	strncat(paxName, name + strlen(name) - ( strlen(name) > 80 ? 80 : strlen(name) ), 80);
+
+	if ( tarBlock(file, paxName, "", 'x', total, mtime) == -1 )
+		return -1;
+
+	if ( fprintf(file, "%s path=%s\n", digits, name) < 0 )
+		return -1;
+
+	return writeTarPadding(file, total);
+
+}
+
+int writeTarHeader(FILE * file, const char * name, unsigned long long int size, time_t mtime) {
+
+	size_t len = strlen(name);
+	char prefix[156];
+	size_t i;
+
+	if ( len <= 100 )
+		return tarBlock(file, name, "", '0', size, mtime);
+
+	/* Split name at separator to prefix (at most 155 chars) and name (at most 100 chars) */
+	for ( i = len - 1; i > 0; --i ) {
+
+		if ( name[i] != '/' )
+			continue;
+
+		if ( len - i - 1 > 100 || len - i - 1 == 0 )
+			break;
+
+		if ( i > 155 )
+			continue;
+
+		memcpy(prefix, name, i);
+		prefix[i] = 0;
+
+		return tarBlock(file, name + i + 1, prefix, '0', size, mtime);
+
+	}
+
+	if ( tarPaxPath(file, name, mtime) == -1 )
+		return -1;
+
+	/* Readers without pax support get at least end of name */
+	return tarBlock(file, name + len - 100, "", '0', size, mtime);
+
+}
+
+int writeTarPadding(FILE * file, unsigned long long int size) {
+
+	char block[TAR_BLOCK];
+	size_t pad = ( TAR_BLOCK - size % TAR_BLOCK ) % TAR_BLOCK;
+
+	memset(block, 0, sizeof(block));
+
+	if ( pad && fwrite(block, 1, pad, file) != pad )
+		return -1;
+
+	return 0;
+
+}
+
+int writeTarEnd(FILE * file) {
+
+	char block[TAR_BLOCK * 2];
+
+	memset(block, 0, sizeof(block));
+
+	if ( fwrite(block, 1, sizeof(block), file) != sizeof(block) )
+		return -1;
+
+	return 0;
+
+}
@@ -0,0 +1,57 @@
+#
+#    common.sh - shared setup of tests for StormLib MPQ archiving utility
+#    Copyright (C) 2010 - 2016  Pali Rohár <pali.rohar@gmail.com>
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+#
+
+# Each test is run as: sh test.sh /path/to/smpq [1 when smpq is built with zlib]
+# It works in own temporary directory, which is removed at exit
+
+SMPQ="$1"
+
+if [ -z "$SMPQ" ] || [ ! -x "$SMPQ" ]; then
+	echo "Usage: $0 /path/to/smpq" >&2
+	exit 1
+fi
+
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+cd "$TMP" || exit 1
+
+fail() {
+	echo "$0: $*" >&2
+	exit 1
+}
+
+# Create directory src with files of different content and one file in subdirectory
+createFiles() {
+	mkdir -p src/dir || fail "cannot create src"
+	printf 'text file\n' > src/a.txt
+	dd if=/dev/urandom of=src/b.bin bs=1024 count=40 2>/dev/null
+	awk 'BEGIN { for ( i = 0; i < 5000; ++i ) printf "x" }' > src/dir/c.txt
+	: > src/empty
+	touch -t 200001010000 src/a.txt src/b.bin src/dir/c.txt src/empty
+}
+
+# Create archive from files in src with names relative to src
+createArchive() {
+	( cd src && "$SMPQ" -c -q "../$1" a.txt b.bin dir/c.txt empty ) || fail "cannot create archive $1"
+}
+
+# Unsigned little endian number of $3 bytes at offset $2 of file $1
+readNumber() {
+	od -An -tu1 -j "$2" -N "$3" "$1" | awk '{ for ( i = NF; i > 0; --i ) n = n * 256 + $i } END { printf "%.0f\n", n }'
+}
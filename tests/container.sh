@@ -0,0 +1,102 @@
+#
+#    container.sh - test of appending files from tar and zip archive (--from-tar and --from-zip)
+#    Copyright (C) 2010 - 2016  Pali Rohár <pali.rohar@gmail.com>
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+#
+
+. "$(dirname "$0")/common.sh"
+
+# Second argument is 1 when smpq is built with zlib (needed for deflated zip entries)
+ZLIB="$2"
+
+createFiles
+
+# Append files from archive $2 (option $1, - for stdin) and compare extracted files with source files
+checkContainer() {
+	rm -rf t.mpq out
+	mkdir out
+
+	if [ "$2" = "-" ]; then
+		"$SMPQ" -c -q "$1" - t.mpq < "$3" || fail "cannot append files from $3 on stdin"
+	else
+		"$SMPQ" -c -q "$1" "$2" t.mpq || fail "cannot append files from $2"
+	fi
+
+	( cd out && "$SMPQ" -x -q ../t.mpq ) || fail "cannot extract files appended from $3"
+	diff -r src out || fail "files appended from $3 differ"
+	[ out/a.txt -nt stamp ] && fail "files appended from $3 have wrong modification time"
+	return 0
+}
+
+touch -t 200001020000 stamp
+
+( cd src && tar -cf ../in.tar a.txt b.bin dir/c.txt empty ) || fail "cannot create tar archive"
+checkContainer --from-tar in.tar in.tar
+checkContainer --from-tar - in.tar
+
+if ! command -v zip > /dev/null; then
+	echo "$0: zip not found, zip archives are not tested"
+	exit 0
+fi
+
+( cd src && zip -q -0 -X ../stored.zip a.txt b.bin dir/c.txt empty ) || fail "cannot create zip archive"
+checkContainer --from-zip stored.zip stored.zip
+checkContainer --from-zip - stored.zip
+
+# Entries with data descriptor (sizes are also in local headers) and with zip64 extended information
+( cd src && zip -q -0 -fd -X ../descriptor.zip a.txt b.bin dir/c.txt empty ) || fail "cannot create zip archive with data descriptors"
+checkContainer --from-zip - descriptor.zip
+( cd src && zip -q -0 -fz -X ../zip64.zip a.txt b.bin dir/c.txt empty ) || fail "cannot create zip64 archive"
+checkContainer --from-zip - zip64.zip
+
+if [ "$ZLIB" = "1" ]; then
+	( cd src && zip -q -9 -X ../deflated.zip a.txt b.bin dir/c.txt empty ) || fail "cannot create zip archive"
+	checkContainer --from-zip deflated.zip deflated.zip
+	checkContainer --from-zip - deflated.zip
+	( cd src && zip -q -9 -fd -fz -X ../deflated64.zip a.txt b.bin dir/c.txt empty ) || fail "cannot create zip64 archive with data descriptors"
+	checkContainer --from-zip - deflated64.zip
+fi
+
+if ! command -v python3 > /dev/null; then
+	echo "$0: python3 not found, streamed zip archives are not tested"
+	exit 0
+fi
+
+# Zip archive written to pipe has zero sizes in local headers, stored data end at data descriptor
+streamZip() {
+	python3 - "$@" <<'EOF_PYTHON'
+import os, sys, zipfile
+method = zipfile.ZIP_DEFLATED if sys.argv[1] == 'deflated' else zipfile.ZIP_STORED
+with zipfile.ZipFile(sys.stdout.buffer, 'w', method) as archive:
+    for name in ['a.txt', 'b.bin', 'dir/c.txt', 'empty']:
+        info = zipfile.ZipInfo.from_file(os.path.join('src', name), name)
+        info.compress_type = method
+        with open(os.path.join('src', name), 'rb') as data, archive.open(info, 'w', force_zip64=(sys.argv[2] == 'zip64')) as entry:
+            entry.write(data.read())
+EOF_PYTHON
+}
+
+streamZip stored zip32 | cat > streamed.zip || fail "cannot create streamed zip archive"
+checkContainer --from-zip - streamed.zip
+streamZip stored zip64 | cat > streamed64.zip || fail "cannot create streamed zip64 archive"
+checkContainer --from-zip - streamed64.zip
+
+if [ "$ZLIB" = "1" ]; then
+	streamZip deflated zip64 | cat > deflated-streamed64.zip || fail "cannot create streamed deflated zip64 archive"
+	checkContainer --from-zip - deflated-streamed64.zip
+fi
+
+exit 0
@@ -0,0 +1,55 @@
+#
+#    framed.sh - test of extracting files to stdout (--to-stdout and --framed)
+#    Copyright (C) 2010 - 2016  Pali Rohár <pali.rohar@gmail.com>
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+#
+
+. "$(dirname "$0")/common.sh"
+
+createFiles
+createArchive a.mpq
+
+# Data of one file are written without any header
+"$SMPQ" -x --to-stdout a.mpq b.bin > out || fail "cannot extract to stdout"
+cmp -s out src/b.bin || fail "data written to stdout differ"
+
+# Each record is name length (4 bytes), name, data length (8 bytes) and data
+"$SMPQ" -x --framed a.mpq > framed || fail "cannot extract framed records"
+
+size=$(wc -c < framed)
+pos=0
+records=0
+
+while [ "$pos" -lt "$size" ]; do
+
+	length=$(readNumber framed "$pos" 4)
+	name=$(dd if=framed bs=1 skip=$((pos + 4)) count="$length" 2>/dev/null)
+	pos=$((pos + 4 + length))
+
+	length=$(readNumber framed "$pos" 8)
+	dd if=framed of=data bs=1 skip=$((pos + 8)) count="$length" 2>/dev/null
+	pos=$((pos + 8 + length))
+
+	[ -f "src/$name" ] || fail "unexpected record name $name"
+	cmp -s data "src/$name" || fail "data of record $name differ"
+	records=$((records + 1))
+
+done
+
+[ "$pos" -eq "$size" ] || fail "last record is truncated"
+[ "$records" -eq 4 ] || fail "expected 4 records, found $records"
+
+exit 0
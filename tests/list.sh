@@ -0,0 +1,45 @@
+#
+#    list.sh - test of list formats longer than output buffer
+#    Copyright (C) 2010 - 2016  Pali Rohár <pali.rohar@gmail.com>
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+#
+
+. "$(dirname "$0")/common.sh"
+
+# Listing of many files with long names does not fit to output buffer, lines are not cut on its boundary
+mkdir src || fail "cannot create src"
+awk 'BEGIN { for ( i = 0; i < 2000; ++i ) { name = sprintf("name_%04d_", i); for ( j = 0; j < i % 200; ++j ) name = name "n"; print name ".txt" } }' > names.txt
+( cd src && while read -r name; do printf '%s' "$name" > "$name"; done ) < names.txt
+sort names.txt > expected.txt
+
+( cd src && "$SMPQ" -c -q ../a.mpq $(cat ../names.txt) ) || fail "cannot create archive"
+
+"$SMPQ" -l a.mpq > text.txt || fail "cannot list files as text"
+awk '{ print $4 }' text.txt | sort | diff expected.txt - || fail "wrong names in text listing"
+awk '$1 != length($4) { exit 1 }' text.txt || fail "wrong sizes in text listing"
+
+"$SMPQ" -l --format ndjson a.mpq > ndjson.txt || fail "cannot list files as ndjson"
+sed -n 's/^{"name":"\([^"]*\)","size":\([0-9]*\),.*}$/\1 \2/p' ndjson.txt > parsed.txt
+awk '{ print $1 }' parsed.txt | sort | diff expected.txt - || fail "wrong names in ndjson listing"
+awk '$2 != length($1) { exit 1 }' parsed.txt || fail "wrong sizes in ndjson listing"
+
+"$SMPQ" -l --format csv a.mpq > csv.txt || fail "cannot list files as csv"
+[ "$(head -n 1 csv.txt)" = "name,size,compressed,flags,locale,offset,time" ] || fail "wrong csv header"
+tail -n +2 csv.txt | awk -F , '$2 != length($1) { exit 1 } { print $1 }' | sort | diff expected.txt - || fail "wrong csv listing"
+
+"$SMPQ" -l --format nul a.mpq | tr '\0' '\n' | sort | diff expected.txt - || fail "wrong nul separated listing"
+
+exit 0
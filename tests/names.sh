@@ -0,0 +1,57 @@
+#
+#    names.sh - test of extracting files with exact names from names file (-T)
+#    Copyright (C) 2010 - 2016  Pali Rohár <pali.rohar@gmail.com>
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+#
+
+. "$(dirname "$0")/common.sh"
+
+mkdir -p src/dir || fail "cannot create src"
+printf 'first\n' > src/a.txt
+printf 'second\n' > src/dir/b.txt
+printf 'not extracted\n' > src/c.txt
+
+( cd src && "$SMPQ" -c -q ../a.mpq a.txt dir/b.txt c.txt ) || fail "cannot create archive"
+
+# All names are found, empty lines and CR of CRLF line ends are ignored, duplicate names are extracted once
+printf 'a.txt\r\n\ndir/b.txt\na.txt\n' > names
+mkdir out
+( cd out && "$SMPQ" -x -T ../names ../a.mpq ) > log 2>&1 || fail "extracting of existing names failed"
+[ -s log ] && fail "extracting of existing names printed messages"
+[ "$(cat out/a.txt out/dir/b.txt)" = "$(printf 'first\nsecond')" ] || fail "wrong extracted files"
+[ -e out/c.txt ] && fail "not listed file was extracted"
+
+# Missing names are reported together after found files are extracted and exit status is error
+printf 'missing1\na.txt\nmissing2\nmissing1\ndir/b.txt\n' > names
+rm -rf out
+mkdir out
+( cd out && "$SMPQ" -x -T - ../a.mpq < ../names ) > log 2>&1 && fail "missing names did not give error exit status"
+[ "$(cat out/a.txt out/dir/b.txt)" = "$(printf 'first\nsecond')" ] || fail "found names were not extracted with missing names"
+grep -q "Cannot find 2 files listed in \`-'" log || fail "summary of missing names was not printed"
+[ "$(grep -c "Cannot find file in archive" log)" -eq 2 ] || fail "missing names were not reported once"
+grep -q "\`missing1'" log && grep -q "\`missing2'" log || fail "missing names were not listed"
+[ "$(tail -n 1 log | sed 's/.*`\(.*\)'"'"'.*/\1/')" = missing2 ] || fail "missing names were not reported at end"
+
+# Quiet mode prints nothing, but exit status is still error
+rm -rf out
+mkdir out
+( cd out && "$SMPQ" -x -q -T ../names ../a.mpq ) > log 2>&1 && fail "missing names did not give error exit status in quiet mode"
+[ -s log ] && fail "quiet mode printed messages"
+
+# Names file which cannot be opened is error
+( cd out && "$SMPQ" -x -q -T ../nonexistent ../a.mpq ) && fail "missing names file did not give error exit status"
+
+exit 0
@@ -0,0 +1,46 @@
+#
+#    order.sh - test of extracting files in order of their blocks
+#    Copyright (C) 2010 - 2016  Pali Rohár <pali.rohar@gmail.com>
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+#
+
+. "$(dirname "$0")/common.sh"
+
+# Removed and replaced files get new blocks, so order of blocks differs from order in which files were added
+mkdir src || fail "cannot create src"
+for name in a b c d e f; do
+	dd if=/dev/urandom of="src/$name.bin" bs=1000 count=3 2>/dev/null
+done
+
+( cd src && "$SMPQ" -c -q ../a.mpq a.bin b.bin c.bin d.bin e.bin f.bin ) || fail "cannot create archive"
+( cd src && "$SMPQ" -d -q ../a.mpq b.bin && "$SMPQ" -a -q ../a.mpq b.bin ) || fail "cannot replace file"
+dd if=/dev/urandom bs=100 count=1 2>/dev/null >> src/d.bin
+( cd src && "$SMPQ" -a -q -f ../a.mpq d.bin ) || fail "cannot overwrite file"
+
+# Verbose mode reports backward seeks of read order and of hash table order, files are read without going back
+for jobs in 1 4; do
+	rm -rf out
+	mkdir out
+	( cd out && "$SMPQ" -x -v -j "$jobs" ../a.mpq ) > log || fail "cannot extract files with $jobs jobs"
+	diff -r src out || fail "files extracted with $jobs jobs differ"
+	sed -n 's/.*Read archive with \([0-9]*\) backward seeks (\([0-9]*\) bytes), order of hash table needs \([0-9]*\) (\([0-9]*\) bytes).*/\1 \2 \3 \4/p' log > seeks
+	[ -s seeks ] || fail "seeks were not reported with $jobs jobs"
+	read seeks bytes tableSeeks tableBytes < seeks
+	[ "$seeks" = 0 ] && [ "$bytes" = 0 ] || fail "archive was read with $seeks backward seeks with $jobs jobs"
+	[ "$tableSeeks" -ge "$seeks" ] && [ "$tableBytes" -ge "$bytes" ] || fail "order of hash table has less seeks with $jobs jobs"
+done
+
+exit 0
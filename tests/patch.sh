@@ -0,0 +1,60 @@
+#
+#    patch.sh - test of extracting files from patched archives by more jobs
+#    Copyright (C) 2010 - 2016  Pali Rohár <pali.rohar@gmail.com>
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+#
+
+. "$(dirname "$0")/common.sh"
+
+# Base archive and chain of two patched archives, second with prefix, files from last archive win
+mkdir -p base patch1 patch2/prefix || fail "cannot create directories"
+i=0
+while [ $i -lt 20 ]; do
+	printf 'base %s\n' $i > "base/f$i.txt"
+	i=$((i + 1))
+done
+printf 'patch1 2\n' > patch1/f2.txt
+printf 'patch1 3\n' > patch1/f3.txt
+printf 'patch1 new\n' > patch1/new1.txt
+printf 'patch2 3\n' > patch2/prefix/f3.txt
+printf 'patch2 new\n' > patch2/prefix/new2.txt
+printf 'other prefix\n' > patch2/f4.txt
+
+( cd base && "$SMPQ" -c -q ../base.mpq $(ls) ) || fail "cannot create base archive"
+( cd patch1 && "$SMPQ" -c -q ../patch1.mpq f2.txt f3.txt new1.txt ) || fail "cannot create first patched archive"
+( cd patch2 && "$SMPQ" -c -q ../patch2.mpq prefix/f3.txt prefix/new2.txt f4.txt ) || fail "cannot create second patched archive"
+
+mkdir expected
+cp base/* expected/
+cp patch1/* expected/
+cp patch2/prefix/* expected/
+
+# Each worker opens its own handle of base archive with whole chain of patched archives
+for jobs in 1 4; do
+	rm -rf out
+	mkdir out
+	( cd out && "$SMPQ" -x -q -j "$jobs" ../base.mpq -p :../patch1.mpq prefix:../patch2.mpq -- ) || fail "cannot extract patched files with $jobs jobs"
+	diff -r expected out || fail "patched files extracted with $jobs jobs differ"
+done
+
+# Only selected files
+rm -rf out
+mkdir out
+( cd out && "$SMPQ" -x -q -j 4 ../base.mpq -p :../patch1.mpq prefix:../patch2.mpq -- f3.txt new2.txt f5.txt ) || fail "cannot extract selected patched files"
+[ "$(cat out/f3.txt out/new2.txt out/f5.txt)" = "$(printf 'patch2 3\npatch2 new\nbase 5')" ] || fail "wrong selected patched files"
+[ "$(ls out | wc -l)" -eq 3 ] || fail "other patched files were extracted"
+
+exit 0
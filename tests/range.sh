@@ -0,0 +1,71 @@
+#
+#    range.sh - test of extracting part of each file (--range)
+#    Copyright (C) 2010 - 2016  Pali Rohár <pali.rohar@gmail.com>
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+#
+
+. "$(dirname "$0")/common.sh"
+
+createFiles
+createArchive a.mpq
+( cd src && "$SMPQ" -c -q -C none ../stored.mpq a.txt b.bin dir/c.txt empty ) || fail "cannot create archive without compression"
+
+# Expected part of file $1 from offset $2 with length $3 (empty - to end of file)
+part() {
+	if [ -n "$3" ]; then
+		dd if="$1" bs=1 skip="$2" count="$3" 2>/dev/null
+	else
+		dd if="$1" bs=1 skip="$2" 2>/dev/null
+	fi
+}
+
+# Extract files of archive $1 with range option $4 and compare them with parts at offset $2 with length $3
+checkRange() {
+	rm -rf out
+	mkdir out
+	( cd out && "$SMPQ" -x -q --range "$4" "../$1" ) || fail "cannot extract $1 with range $4"
+
+	for file in a.txt b.bin dir/c.txt empty; do
+		part "src/$file" "$2" "$3" > expected
+		cmp -s expected "out/$file" || fail "file $file from $1 with range $4 differs"
+	done
+}
+
+for archive in a.mpq stored.mpq; do
+	checkRange "$archive" 100 50 100:50
+	checkRange "$archive" 5000 "" 5000:
+	checkRange "$archive" 1024 1024 1K:1K
+	checkRange "$archive" 40000 5000 40000:5000
+	checkRange "$archive" 50000 10 50000:10
+	checkRange "$archive" 0 "" 0:
+done
+
+# Range is applied also to stdout and tar archive
+"$SMPQ" -x --to-stdout --range 3:4 a.mpq a.txt > out.txt || fail "cannot extract range to stdout"
+part src/a.txt 3 4 | cmp -s - out.txt || fail "range written to stdout differs"
+
+"$SMPQ" -x --tar out.tar --range 10:20000 a.mpq b.bin || fail "cannot extract range to tar archive"
+mkdir tar && tar -xf out.tar -C tar || fail "tar cannot read created archive"
+part src/b.bin 10 20000 | cmp -s - tar/b.bin || fail "range in tar archive differs"
+
+# Invalid ranges are rejected
+"$SMPQ" -x -q --range 100 a.mpq 2>/dev/null && fail "range without length was accepted"
+"$SMPQ" -x -q --range x:1 a.mpq 2>/dev/null && fail "range with invalid offset was accepted"
+for range in 5x:10 1:2junk 1K2:1 1:1KK :1 1:-1 18446744073709551616:1 1:18014398509481984K; do
+	"$SMPQ" -x -q --range "$range" a.mpq 2>/dev/null && fail "range $range with trailing junk or overflow was accepted"
+done
+
+exit 0
@@ -0,0 +1,65 @@
+#
+#    sizes.sh - test of parsing size options
+#    Copyright (C) 2010 - 2016  Pali Rohár <pali.rohar@gmail.com>
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+#
+
+. "$(dirname "$0")/common.sh"
+
+mkdir src || fail "cannot create src"
+printf 'first\n' > src/a.txt
+dd if=/dev/urandom of=src/b.bin bs=1024 count=3 2>/dev/null
+
+# Sizes are decimal numbers with optional single suffix K, M or G
+for size in 0 1 2048 2K 1k 1M 1G; do
+	rm -f a.mpq
+	( cd src && "$SMPQ" -c -q --commit-bytes "$size" ../a.mpq a.txt b.bin ) || fail "size $size for commit was rejected"
+	rm -rf out
+	mkdir out
+	( cd out && "$SMPQ" -x -q ../a.mpq ) || fail "cannot extract archive committed after $size"
+	diff -r src out || fail "extracted files differ for archive committed after $size"
+done
+
+# Junk, more suffixes, negative numbers and overflow are rejected before archive is created
+for size in "" K 1x 1KK 1K2 -1 " 1" 0x10 18446744073709551616 18014398509481984K; do
+	rm -f a.mpq
+	( cd src && "$SMPQ" -c -q --commit-bytes "$size" ../a.mpq a.txt 2>/dev/null ) && fail "invalid size '$size' for commit was accepted"
+	[ -e a.mpq ] && fail "archive was created with invalid size '$size' for commit"
+done
+
+# Sector size must be power of 2 from 512 to 16M
+for size in 512:512 4K:4096 64k:65536 16M:16777216; do
+	rm -f a.mpq
+	( cd src && "$SMPQ" -c -q --sector-size "${size%%:*}" ../a.mpq a.txt b.bin ) || fail "sector size ${size%%:*} was rejected"
+	"$SMPQ" -i a.mpq | grep -qx "Sector size: ${size#*:}" || fail "sector size ${size%%:*} was not used"
+done
+for size in 256 1000 32M 4Kx 4K4 "" 18446744073709551616; do
+	rm -f a.mpq
+	( cd src && "$SMPQ" -c -q --sector-size "$size" ../a.mpq a.txt 2>/dev/null ) && fail "invalid sector size '$size' was accepted"
+done
+
+# Files up to threshold are added as single unit
+for size in 0:0 6:1 3K:2 1G:2; do
+	rm -f a.mpq
+	( cd src && "$SMPQ" -c -q --single-unit-threshold "${size%%:*}" ../a.mpq a.txt b.bin ) || fail "single unit threshold ${size%%:*} was rejected"
+	"$SMPQ" -i a.mpq | grep -qx "Single unit files: ${size#*:}" || fail "wrong number of single unit files for threshold ${size%%:*}"
+done
+for size in 1x 1MM -5 " 6" 18014398509481984K; do
+	rm -f a.mpq
+	( cd src && "$SMPQ" -c -q --single-unit-threshold "$size" ../a.mpq a.txt 2>/dev/null ) && fail "invalid single unit threshold '$size' was accepted"
+done
+
+exit 0
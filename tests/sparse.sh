@@ -0,0 +1,77 @@
+#
+#    sparse.sh - test of extracting files with zero blocks as sparse files
+#    Copyright (C) 2010 - 2016  Pali Rohár <pali.rohar@gmail.com>
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+#
+
+. "$(dirname "$0")/common.sh"
+
+# Files up to 16 MiB are written by asynchronous writer, bigger ones directly
+mkdir src || fail "cannot create src"
+dd if=/dev/urandom of=src/small.bin bs=4096 count=1 seek=512 2>/dev/null
+dd if=/dev/zero of=src/small.bin bs=4096 count=0 seek=1024 2>/dev/null
+dd if=/dev/urandom of=src/big.bin bs=4096 count=1 seek=2048 2>/dev/null
+dd if=/dev/zero of=src/big.bin bs=4096 count=0 seek=5120 2>/dev/null
+dd if=/dev/zero of=src/zero.bin bs=4096 count=256 2>/dev/null
+
+# Holes at end of file: unaligned size after long hole and few zero bytes in last sector
+dd if=/dev/urandom of=src/tail.bin bs=4096 count=1 2>/dev/null
+dd if=/dev/zero of=src/tail.bin bs=1 count=0 seek=1048699 2>/dev/null
+dd if=/dev/urandom of=src/short.bin bs=1000 count=5 2>/dev/null
+dd if=/dev/zero of=src/short.bin bs=1 count=0 seek=5100 2>/dev/null
+
+FILES="small.bin big.bin zero.bin tail.bin short.bin"
+( cd src && touch -t 200001010000 $FILES && "$SMPQ" -c -q ../a.mpq $FILES ) || fail "cannot create archive"
+
+for jobs in 1 4; do
+	rm -rf out
+	mkdir out
+	( cd out && "$SMPQ" -x -q -j "$jobs" ../a.mpq ) || fail "cannot extract files with $jobs jobs"
+
+	for file in $FILES; do
+		[ "$(wc -c < "out/$file")" -eq "$(wc -c < "src/$file")" ] || fail "size of $file with hole at end differs with $jobs jobs"
+		cmp -s "src/$file" "out/$file" || fail "data of $file differ with $jobs jobs"
+	done
+done
+
+# Sizes on disk are checked only when filesystem supports holes
+dd if=/dev/zero of=probe bs=4096 count=0 seek=1024 2>/dev/null
+
+if [ "$(du -k probe | cut -f1)" -lt 1024 ]; then
+	[ "$(du -k out/small.bin | cut -f1)" -lt 1024 ] || fail "small.bin is not sparse"
+	[ "$(du -k out/big.bin | cut -f1)" -lt 1024 ] || fail "big.bin is not sparse"
+	[ "$(du -k out/zero.bin | cut -f1)" -lt 64 ] || fail "zero.bin is not sparse"
+	[ "$(du -k out/tail.bin | cut -f1)" -lt 512 ] || fail "tail.bin is not sparse"
+fi
+
+# File which cannot be written completely must not get time from archive, otherwise --update would skip it
+touch -t 200001020000 stamp
+mkdir limit
+( cd limit && trap '' XFSZ && ulimit -f 64 && "$SMPQ" -x -q ../a.mpq ) 2>/dev/null
+
+for file in small.bin big.bin; do
+	if [ -f "limit/$file" ] && [ ! "limit/$file" -nt stamp ]; then
+		fail "incomplete $file has time from archive"
+	fi
+done
+
+( cd limit && "$SMPQ" -x -q --update ../a.mpq ) || fail "cannot update files"
+
+for file in $FILES; do
+	cmp -s "src/$file" "limit/$file" || fail "data of $file differ after update"
+done
+
+exit 0
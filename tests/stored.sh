@@ -0,0 +1,39 @@
+#
+#    stored.sh - test of copying stored files directly from archive file
+#    Copyright (C) 2010 - 2016  Pali Rohár <pali.rohar@gmail.com>
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+#
+
+. "$(dirname "$0")/common.sh"
+
+# Files without compression are copied from archive file (reflink, copy_file_range or pread), block aligned size too
+mkdir -p src/dir || fail "cannot create src"
+dd if=/dev/urandom of=src/aligned.bin bs=4096 count=4 2>/dev/null
+dd if=/dev/urandom of=src/unaligned.bin bs=1 count=300001 2>/dev/null
+dd if=/dev/urandom of=src/dir/big.bin bs=65536 count=40 2>/dev/null
+printf 'stored text\n' > src/dir/text.txt
+: > src/empty
+
+( cd src && "$SMPQ" -c -q -C none ../a.mpq aligned.bin unaligned.bin dir/big.bin dir/text.txt empty ) || fail "cannot create archive"
+
+for jobs in 1 4; do
+	rm -rf out
+	mkdir out
+	( cd out && "$SMPQ" -x -q -j "$jobs" ../a.mpq ) || fail "cannot extract files with $jobs jobs"
+	diff -r src out || fail "stored files extracted with $jobs jobs differ"
+done
+
+exit 0
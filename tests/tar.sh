@@ -0,0 +1,57 @@
+#
+#    tar.sh - test of extracting files to tar archive (--tar)
+#    Copyright (C) 2010 - 2016  Pali Rohár <pali.rohar@gmail.com>
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+#
+
+. "$(dirname "$0")/common.sh"
+
+createFiles
+createArchive a.mpq
+
+touch -t 200001020000 stamp
+
+# Archive is unpacked by system tar, so headers must be valid POSIX tar
+"$SMPQ" -x --tar out.tar a.mpq || fail "cannot extract to tar archive"
+mkdir out && tar -xf out.tar -C out || fail "tar cannot read created archive"
+diff -r src out || fail "files in tar archive differ"
+[ out/a.txt -nt stamp ] && fail "tar archive has wrong modification time"
+
+# Same tar archive is written to stdout
+"$SMPQ" -x --tar - a.mpq > stdout.tar || fail "cannot extract tar archive to stdout"
+cmp -s out.tar stdout.tar || fail "tar archive written to stdout differs"
+
+# Names longer than 100 chars are split to ustar prefix or written to pax header when they cannot be split
+name() { awk -v c="$1" -v n="$2" 'BEGIN { s = ""; for ( i = 0; i < n; ++i ) s = s c; print s }'; }
+exact="$(name e 100)"
+split="$(name d 60)/$(name f 60)"
+single="$(name s 150)"
+deep="$(name x 100)/$(name y 100)/$(name z 120)"
+mkdir -p long/"$(dirname "$split")" long/"$(dirname "$deep")" || fail "cannot create directories with long names"
+for file in "$exact" "$split" "$single" "$deep"; do
+	printf '%s\n' "$file" > "long/$file"
+done
+touch -t 200001010000 long/"$exact" long/"$split" long/"$single" long/"$deep"
+
+( cd long && "$SMPQ" -c -q ../long.mpq "$exact" "$split" "$single" "$deep" ) || fail "cannot create archive with long names"
+"$SMPQ" -x --tar long.tar long.mpq || fail "cannot extract long names to tar archive"
+mkdir longout && tar -xf long.tar -C longout || fail "tar cannot read long names"
+diff -r long longout || fail "files with long names in tar archive differ"
+tar -tf long.tar | grep -v '/$' | sort > names
+printf '%s\n' "$exact" "$split" "$single" "$deep" | sort | diff - names || fail "wrong long names in tar archive"
+[ "$(grep -a -o 'PaxHeaders/' long.tar | wc -l)" -eq 2 ] || fail "pax headers are not used only for names which cannot be split"
+
+exit 0
@@ -0,0 +1,70 @@
+#
+#    update.sh - test of extracting only changed files (--update and --checksum)
+#    Copyright (C) 2010 - 2016  Pali Rohár <pali.rohar@gmail.com>
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+#
+
+. "$(dirname "$0")/common.sh"
+
+createFiles
+createArchive a.mpq
+
+mkdir out
+cd out || fail "cannot enter out"
+
+"$SMPQ" -x -q ../a.mpq || fail "cannot extract files"
+
+# Print summary of update: numbers of skipped and rewritten files
+update() {
+	"$SMPQ" -x -v --update "$@" ../a.mpq > log || fail "cannot update files"
+	sed -n 's/.*Skipped \([0-9]*\) unchanged files ([0-9]* bytes), rewritten \([0-9]*\) changed files.*/\1 \2/p' log
+}
+
+[ "$(update)" = "4 0" ] || fail "unchanged files were not skipped"
+
+# Changed size
+printf 'more data' >> b.bin
+[ "$(update)" = "3 1" ] || fail "file with changed size was not rewritten"
+cmp -s b.bin ../src/b.bin || fail "file with changed size has wrong data"
+
+# Same size, changed time
+printf 'TEXT FILE\n' > a.txt
+[ "$(update)" = "3 1" ] || fail "file with changed time was not rewritten"
+cmp -s a.txt ../src/a.txt || fail "file with changed time has wrong data"
+
+# Same size and time, changed content is found only by MD5
+printf 'y' | dd of=dir/c.txt bs=1 seek=100 conv=notrunc 2>/dev/null
+touch -t 200001010000 dir/c.txt
+[ "$(update)" = "4 0" ] || fail "file with same size and time was not skipped"
+[ "$(update --checksum)" = "3 1" ] || fail "file with changed content was not rewritten with --checksum"
+cmp -s dir/c.txt ../src/dir/c.txt || fail "file with changed content has wrong data"
+[ "$(update --checksum)" = "4 0" ] || fail "unchanged files were not skipped with --checksum"
+
+# Checksum mismatch of multi sector file with modification time copied from source, so size and time are surely same
+printf 'z' | dd of=b.bin bs=1 seek=40959 conv=notrunc 2>/dev/null
+touch -r ../src/b.bin b.bin
+[ b.bin -nt ../src/b.bin ] || [ b.bin -ot ../src/b.bin ] && fail "modification time was not copied"
+[ "$(update)" = "4 0" ] || fail "file with same size and time was not skipped without --checksum"
+[ "$(update --checksum)" = "3 1" ] || fail "file with checksum mismatch and same time was not rewritten with --checksum"
+cmp -s b.bin ../src/b.bin || fail "file with checksum mismatch has wrong data"
+[ b.bin -nt ../src/b.bin ] || [ b.bin -ot ../src/b.bin ] && fail "rewritten file does not have time from archive"
+
+# Files are still extracted
+rm a.txt
+[ "$(update)" = "3 0" ] || fail "missing file was not extracted"
+cmp -s a.txt ../src/a.txt || fail "missing file has wrong data"
+
+exit 0
@@ -0,0 +1,64 @@
+#
+#    writer.sh - test of writing extracted files by io_uring and pool of threads
+#    Copyright (C) 2010 - 2016  Pali Rohár <pali.rohar@gmail.com>
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+#
+
+. "$(dirname "$0")/common.sh"
+
+# More files than one batch of writer, in subdirectories, with empty and multi sector files
+mkdir -p src/d0 src/d1/d2 src/d2 || fail "cannot create src"
+i=0
+while [ $i -lt 40 ]; do
+	dd if=/dev/urandom of="src/d$((i % 3))/f$i.bin" bs=100 count=$((i * 7)) 2>/dev/null
+	i=$((i + 1))
+done
+dd if=/dev/urandom of=src/d1/d2/big.bin bs=1000 count=300 2>/dev/null
+
+( cd src && "$SMPQ" -c -q ../a.mpq $(find . -type f | sed 's|^\./||') ) || fail "cannot create archive"
+
+# Default writer (io_uring when smpq was built with liburing and kernel supports it) and pool of threads give same files
+for writer in default --no-io-uring; do
+	for jobs in 1 4; do
+		rm -rf out
+		mkdir out
+		if [ "$writer" = default ]; then
+			( cd out && "$SMPQ" -x -v -j "$jobs" ../a.mpq ) > log || fail "cannot extract files by default writer with $jobs jobs"
+		else
+			( cd out && "$SMPQ" -x -v -j "$jobs" "$writer" ../a.mpq ) > log || fail "cannot extract files by pool of threads with $jobs jobs"
+			grep -q "Write extracted files by pool of threads" log || fail "pool of threads was not used with $writer"
+		fi
+		diff -r src out || fail "files extracted by $writer writer with $jobs jobs differ"
+	done
+done
+
+# Files which cannot be written completely are removed, other files are written
+for writer in default --no-io-uring; do
+	rm -rf limit
+	mkdir limit
+	if [ "$writer" = default ]; then
+		( cd limit && trap '' XFSZ && ulimit -f 64 && "$SMPQ" -x -q ../a.mpq ) 2>/dev/null
+	else
+		( cd limit && trap '' XFSZ && ulimit -f 64 && "$SMPQ" -x -q "$writer" ../a.mpq ) 2>/dev/null
+	fi
+	[ -e limit/d1/d2/big.bin ] && fail "incomplete file was not removed by $writer writer"
+	cmp src/d1/f1.bin limit/d1/f1.bin || fail "small file was not written by $writer writer"
+	for file in $(cd limit && find . -type f); do
+		cmp "src/$file" "limit/$file" || fail "file $file written by $writer writer differs"
+	done
+done
+
+exit 0
@@ -0,0 +1,607 @@
+/*
+    writer.c - StormLib MPQ archiving utility
+    Copyright (C) 2010 - 2016  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* Asynchronous writing of extracted files, decompressing thread only passes data of file to writer */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "common.h"
+
+#if ! defined(WIN32) && ! defined(_MSC_VER)
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Blocks with only zeros are not written, file system does not allocate them (sparse file) */
+#define SPARSE_BLOCK 4096
+
+/* Return nonzero when block has only zeros */
+static int zeroBlock(const unsigned char * data, size_t size) {
+
+	return size != 0 && data[0] == 0 && memcmp(data, data + 1, size - 1) == 0;
+
+}
+
+/* Return length of block which starts at offset, blocks are aligned in file */
+static size_t blockLength(unsigned long long int offset, size_t size) {
+
+	size_t length = SPARSE_BLOCK - offset % SPARSE_BLOCK;
+
+	return length < size ? length : size;
+
+}
+
+int writeSparse(int fd, const void * data, size_t size, unsigned long long int offset) {
+
+	const unsigned char * ptr = (const unsigned char *)data;
+
+	while ( size != 0 ) {
+
+		size_t length = blockLength(offset, size);
+		ssize_t bytes;
+
+		if ( zeroBlock(ptr, length) ) {
+
+			ptr += length;
+			offset += length;
+			size -= length;
+			continue;
+
+		}
+
+		/* Adjacent blocks with data are written by one syscall */
+		while ( length < size && ! zeroBlock(ptr + length, blockLength(offset + length, size - length)) )
+			length += blockLength(offset + length, size - length);
+
+		while ( length != 0 ) {
+
+			bytes = pwrite(fd, ptr, length, offset);
+
+			if ( bytes < 0 && errno == EINTR )
+				continue;
+
+			if ( bytes <= 0 ) {
+
+				if ( bytes == 0 )
+					errno = ENOSPC;
+
+				return -1;
+
+			}
+
+			ptr += bytes;
+			offset += bytes;
+			size -= bytes;
+			length -= bytes;
+
+		}
+
+	}
+
+	return 0;
+
+}
+
+#endif
+
+#ifdef HAVE_ASYNC_WRITER
+
+#include <pthread.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/* Writer accepts new files only while data of pending files has at most this size */
+#define WRITER_PENDING_MAX 0x4000000
+
+/* Number of files submitted to io_uring at once, each file needs four submission entries */
+#define WRITER_BATCH 32
+
+/* File waiting for writing, name is relative to directory descriptor and fileName is used for errors */
+struct request {
+
+	struct request * next;
+
+	int dirFd;
+	const char * name;
+	const char * fileName;
+
+	unsigned char * data;
+	size_t size;
+	time_t mtime;
+
+};
+
+struct writer {
+
+	const char * archive;
+	unsigned int flags;
+
+	/* Queue of pending files (head is written first) */
+	struct request * head;
+	struct request * tail;
+	unsigned long long int pendingBytes;
+	int end;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	pthread_t * threads;
+	unsigned int started;
+
+#ifdef HAVE_LIBURING
+	struct io_uring ring;
+	int uring;
+#endif
+
+};
+
+/* Take next file from queue, wait when queue is empty, return NULL at end */
+static struct request * takeRequest(struct writer * w) {
+
+	struct request * r;
+
+	pthread_mutex_lock(&w->mutex);
+
+	while ( ! w->end && ! w->head )
+		pthread_cond_wait(&w->cond, &w->mutex);
+
+	r = w->head;
+
+	if ( r ) {
+
+		w->head = r->next;
+
+		if ( ! w->head )
+			w->tail = NULL;
+
+	}
+
+	pthread_mutex_unlock(&w->mutex);
+
+	return r;
+
+}
+
+/* Take file from queue without waiting, return NULL when queue is empty */
+#ifdef HAVE_LIBURING
+static struct request * pollRequest(struct writer * w) {
+
+	struct request * r;
+
+	pthread_mutex_lock(&w->mutex);
+
+	r = w->head;
+
+	if ( r ) {
+
+		w->head = r->next;
+
+		if ( ! w->head )
+			w->tail = NULL;
+
+	}
+
+	pthread_mutex_unlock(&w->mutex);
+
+	return r;
+
+}
+#endif
+
+/* Set modification time of written file, free its data and allow submitting of next files */
+static void finishRequest(struct writer * w, struct request * r, int ok) {
+
+	if ( ok ) {
+
+		struct timespec fileTimes[2];
+		fileTimes[0].tv_sec = r->mtime;
+		fileTimes[0].tv_nsec = 0;
+		fileTimes[1] = fileTimes[0];
+		utimensat(r->dirFd, r->name, fileTimes, 0);
+
+	}
+
+	pthread_mutex_lock(&w->mutex);
+	w->pendingBytes -= r->size;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
+
+	free(r->data);
+	free(r);
+
+}
+
+/* Return nonzero when data have block with only zeros, such file is written as sparse */
+static int sparseData(const unsigned char * data, size_t size) {
+
+	size_t offset;
+
+	for ( offset = 0; offset < size; offset += SPARSE_BLOCK )
+		if ( zeroBlock(data + offset, size - offset < SPARSE_BLOCK ? size - offset : SPARSE_BLOCK) )
+			return 1;
+
+	return 0;
+
+}
+
+/* Write file by blocking syscalls, used by thread pool */
+static void writeRequest(struct writer * w, struct request * r) {
+
+	int sparse = sparseData(r->data, r->size);
+	int ok = 1;
+	int fd;
+
+	fd = openat(r->dirFd, r->name, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+
+	if ( fd == -1 ) {
+
+		if ( ! ( w->flags & QUIET ) )
+			printError(w->archive, "Cannot open file", r->fileName, errno);
+
+		finishRequest(w, r, 0);
+		return;
+
+	}
+
+#ifdef __linux__
+	/* Reserve blocks at once, so file is not fragmented by other writer threads, error is not fatal */
+	if ( ! sparse && r->size != 0 )
+		fallocate(fd, 0, 0, r->size);
+#endif
+
+	/* Sparse file gets final size first, blocks with zeros are skipped and stay as holes */
+	if ( ( sparse && ftruncate(fd, r->size) != 0 ) || writeSparse(fd, r->data, r->size, 0) != 0 ) {
+
+		if ( ! ( w->flags & QUIET ) )
+			printError(w->archive, "Cannot write file", r->fileName, errno);
+
+		ok = 0;
+
+	}
+
+	if ( close(fd) != 0 && ok ) {
+
+		if ( ! ( w->flags & QUIET ) )
+			printError(w->archive, "Cannot write file", r->fileName, errno);
+
+		ok = 0;
+
+	}
+
+	/* File has final size before data are written, so incomplete file would look unchanged for update */
+	if ( ! ok )
+		unlinkat(r->dirFd, r->name, 0);
+
+	finishRequest(w, r, ok);
+
+}
+
+static void * poolThread(void * arg) {
+
+	struct writer * w = (struct writer *)arg;
+	struct request * r;
+
+	while ( ( r = takeRequest(w) ) )
+		writeRequest(w, r);
+
+	return NULL;
+
+}
+
+#ifdef HAVE_LIBURING
+
+/**
+ * Prepare chain openat, fallocate, write and close for file in slot of registered files
+ *
+ * Failed openat cancels whole chain. Fallocate and write are hard linked, so close is submitted also after their error.
+ */
+static void prepareRequest(struct io_uring * ring, struct request * r, unsigned int slot) {
+
+	struct io_uring_sqe * sqe;
+
+	sqe = io_uring_get_sqe(ring);
+	io_uring_prep_openat_direct(sqe, r->dirFd, r->name, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666, slot);
+	sqe->flags |= IOSQE_IO_LINK;
+	io_uring_sqe_set_data(sqe, r);
+
+	sqe = io_uring_get_sqe(ring);
+	io_uring_prep_fallocate(sqe, slot, 0, 0, r->size);
+	sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+	io_uring_sqe_set_data(sqe, (char *)r + 1);
+
+	sqe = io_uring_get_sqe(ring);
+	io_uring_prep_write(sqe, slot, r->data, r->size, 0);
+	sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+	io_uring_sqe_set_data(sqe, (char *)r + 2);
+
+	sqe = io_uring_get_sqe(ring);
+	io_uring_prep_close_direct(sqe, slot);
+	io_uring_sqe_set_data(sqe, (char *)r + 3);
+
+}
+
+/* Submit files in batches, one syscall submits whole batch and waits for its completion */
+static void * uringThread(void * arg) {
+
+	struct writer * w = (struct writer *)arg;
+	struct request * batch[WRITER_BATCH];
+	int errors[WRITER_BATCH];
+	int created[WRITER_BATCH];
+	unsigned int count;
+	unsigned int i;
+
+	while ( ( batch[0] = takeRequest(w) ) ) {
+
+		count = 1;
+
+		while ( count < WRITER_BATCH && ( batch[count] = pollRequest(w) ) )
+			++count;
+
+		/* Chain has one write, so sparse files are written by blocking syscalls */
+		for ( i = 0; i < count; ++i ) {
+
+			if ( sparseData(batch[i]->data, batch[i]->size) ) {
+
+				writeRequest(w, batch[i]);
+				batch[i--] = batch[--count];
+				continue;
+
+			}
+
+			prepareRequest(&w->ring, batch[i], i);
+			errors[i] = 0;
+			created[i] = 0;
+
+		}
+
+		if ( count == 0 )
+			continue;
+
+		io_uring_submit_and_wait(&w->ring, count * 4);
+
+		for ( i = 0; i < count * 4; ++i ) {
+
+			struct io_uring_cqe * cqe;
+			unsigned int op;
+			unsigned int j;
+			char * data;
+			int ret;
+
+			while ( ( ret = io_uring_wait_cqe(&w->ring, &cqe) ) == -EINTR )
+				;
+
+			if ( ret != 0 )
+				break;
+
+			data = (char *)io_uring_cqe_get_data(cqe);
+			op = (size_t)data & 3;
+
+			for ( j = 0; j < count; ++j )
+				if ( (char *)batch[j] == data - op )
+					break;
+
+			/* First error of file is reported, errors of fallocate are ignored (filesystem does not have to support it) */
+			if ( j < count && ! errors[j] && op != 1 ) {
+
+				if ( op == 0 && cqe->res >= 0 )
+					created[j] = 1;
+
+				if ( cqe->res < 0 && cqe->res != -ECANCELED )
+					errors[j] = -cqe->res;
+				else if ( op == 2 && (size_t)cqe->res != batch[j]->size )
+					errors[j] = ENOSPC;
+
+				if ( errors[j] && ! ( w->flags & QUIET ) )
+					printError(w->archive, op == 0 ? "Cannot open file" : "Cannot write file", batch[j]->fileName, errors[j]);
+
+			}
+
+			io_uring_cqe_seen(&w->ring, cqe);
+
+		}
+
+		/* Time is set after close, io_uring does not have utimensat operation, incomplete files are removed */
+		for ( i = 0; i < count; ++i ) {
+
+			if ( errors[i] && created[i] )
+				unlinkat(batch[i]->dirFd, batch[i]->name, 0);
+
+			finishRequest(w, batch[i], ! errors[i]);
+
+		}
+
+	}
+
+	return NULL;
+
+}
+
+/* Create ring with slots for registered files, return -1 when kernel does not support it */
+static int startUring(struct writer * w) {
+
+	int fds[WRITER_BATCH];
+	unsigned int i;
+
+	if ( io_uring_queue_init(WRITER_BATCH * 4, &w->ring, 0) != 0 )
+		return -1;
+
+	for ( i = 0; i < WRITER_BATCH; ++i )
+		fds[i] = -1;
+
+	if ( io_uring_register_files(&w->ring, fds, WRITER_BATCH) != 0 ) {
+
+		io_uring_queue_exit(&w->ring);
+		return -1;
+
+	}
+
+	if ( pthread_create(&w->threads[0], NULL, uringThread, w) != 0 ) {
+
+		io_uring_queue_exit(&w->ring);
+		return -1;
+
+	}
+
+	w->uring = 1;
+	w->started = 1;
+
+	return 0;
+
+}
+
+#endif
+
+struct writer * writer_open(const char * archive, unsigned int flags, unsigned int threads) {
+
+	struct writer * w = (struct writer *)calloc(1, sizeof(struct writer));
+
+	if ( ! w )
+		return NULL;
+
+	if ( threads == 0 )
+		threads = 1;
+
+	w->archive = archive;
+	w->flags = flags;
+	w->threads = (pthread_t *)calloc(threads, sizeof(pthread_t));
+
+	if ( ! w->threads ) {
+
+		free(w);
+		return NULL;
+
+	}
+
+	pthread_mutex_init(&w->mutex, NULL);
+	pthread_cond_init(&w->cond, NULL);
+
+#ifdef HAVE_LIBURING
+	if ( ! ( flags & NO_URING ) && startUring(w) == 0 ) {
+
+		if ( flags & VERBOSE )
+			printVerbose(archive, "Write extracted files by io_uring", archive);
+
+		return w;
+
+	}
+#endif
+
+	/* Fallback is pool of threads with blocking syscalls */
+	for ( w->started = 0; w->started < threads; ++w->started )
+		if ( pthread_create(&w->threads[w->started], NULL, poolThread, w) != 0 )
+			break;
+
+	if ( w->started != 0 && ( flags & VERBOSE ) )
+		printVerbose(archive, "Write extracted files by pool of threads", archive);
+
+	if ( w->started == 0 ) {
+
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->mutex);
+		free(w->threads);
+		free(w);
+
+		return NULL;
+
+	}
+
+	return w;
+
+}
+
+int writer_submit(struct writer * w, int dirFd, const char * name, const char * fileName, unsigned char * data, size_t size, time_t mtime) {
+
+	size_t nameLength = strlen(name) + 1;
+	size_t fileNameLength = strlen(fileName) + 1;
+	struct request * r = (struct request *)malloc(sizeof(struct request) + nameLength + fileNameLength);
+
+	if ( ! r )
+		return -1;
+
+	r->next = NULL;
+	r->dirFd = dirFd;
+	r->name = memcpy((char *)( r + 1 ), name, nameLength);
+	r->fileName = memcpy((char *)( r + 1 ) + nameLength, fileName, fileNameLength);
+	r->data = data;
+	r->size = size;
+	r->mtime = mtime;
+
+	pthread_mutex_lock(&w->mutex);
+
+	/* Big file is accepted when nothing is pending, so it does not wait forever */
+	while ( w->pendingBytes != 0 && w->pendingBytes + size > WRITER_PENDING_MAX )
+		pthread_cond_wait(&w->cond, &w->mutex);
+
+	w->pendingBytes += size;
+
+	if ( w->tail )
+		w->tail->next = r;
+	else
+		w->head = r;
+
+	w->tail = r;
+
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
+
+	return 0;
+
+}
+
+void writer_close(struct writer * w) {
+
+	unsigned int i;
+
+	pthread_mutex_lock(&w->mutex);
+	w->end = 1;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
+
+	for ( i = 0; i < w->started; ++i )
+		pthread_join(w->threads[i], NULL);
+
+#ifdef HAVE_LIBURING
+	if ( w->uring )
+		io_uring_queue_exit(&w->ring);
+#endif
+
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->mutex);
+	free(w->threads);
+	free(w);
+
+}
+
+#endif